@@ -14,6 +14,8 @@
 // Date: 24 de Novembro de 2023
 //
 
+#define _GNU_SOURCE   // for copy_file_range
+
 #include "image8bit.h"
 
 #include <assert.h>
@@ -21,9 +23,22 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "instrumentation.h"
+#include <limits.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // The data structure
 //
@@ -33,9 +48,33 @@
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
-// For example, in a 100-pixel wide image (img->width == 100),
+// Each row starts img->stride positions after the previous one.
+// The stride is at least the width: the extra positions at the end of
+// each row are padding, which is never part of the image.
+// For example, in a 100-pixel wide image (img->width == 100) with
+// img->stride == 128,
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
-//   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//   pixel position (x,y) = (22,1) is stored in img->pixel[150].
+//
+// The pixels live in a pixel buffer (struct pixbuf), which may be shared:
+// a view created by ImageView is an image whose pixel pointer and stride
+// select a rectangle inside the buffer of its parent.  The buffer counts the
+// images that use it and is released when the last one is destroyed.
+// Before an image is modified in place, prepareWrite gives it a private
+// copy of its pixels if the buffer is shared (copy-on-write), so that
+// neither views nor parents ever see each other's modifications.
+//
+// Usually the buffer is allocated by allocPixbuf, with rows padded to
+// a multiple of ROWALIGN bytes and aligned to ROWALIGN bytes, so that row
+// operations may use aligned vector loads and stores.
+// Images loaded with ImageLoadMapped instead point img->pixel into a
+// private (copy-on-write) memory mapping of the PGM file, which is recorded
+// in the buffer so that it is unmapped instead of freed.
+// Those rows are not padded (img->stride == img->width) and not aligned.
+//
+// An image loaded from a file remembers where its pixels came from
+// (img->src) until it is modified, so that ImageSave can copy them from
+// file to file without going through memory.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -44,14 +83,44 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Alignment (in bytes) of the rows of allocated images
+#define ROWALIGN 64
+
+// Internal structure for a (possibly shared) pixel buffer
+struct pixbuf {
+  int refs;       // number of images using the buffer (updated atomically)
+  void* mem;      // the allocated memory or the file mapping
+  size_t mapsize; // length of the file mapping (0 if mem was allocated)
+  size_t capacity;      // bytes allocated at mem (if not mapped)
+  struct pixbuf* next;  // next free buffer, while in the image pool
+};
+
+// Internal structure for the origin of the pixels of an unmodified image
+// loaded from a file.  The file identity is used to detect later changes.
+struct source {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  off_t offset;   // position of the first pixel in the file
+  char path[];    // the file name
+};
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
+  int stride;   // distance between the starts of consecutive rows
   uint8* pixel; // pixel data (a raster scan)
+  struct pixbuf* buf;  // buffer holding the pixels
+  struct source* src;  // file holding the same pixels (or NULL)
+  struct imageIntegral* integral;  // summed-area tables (or NULL)
+  struct imagePyramid* pyramid;    // downsampled levels (or NULL)
 };
 
+static void pyramidFree(struct imagePyramid* pyr);
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -140,17 +209,26 @@ static int check(int condition, const char* failmsg) {
 }
 
 
+// Permissions mask of new files (the process umask), read by ImageInit.
+// Reading the umask means setting it, which is not safe once other threads
+// may be creating files, so it is done only once.
+static mode_t fileMask = 022;
+
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) { ///
   InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "pixcmp";  // InstrCount[1] will count pixels compared in searches
   // Name other counters here...
   
+  fileMask = umask(0);
+  umask(fileMask);
 }
 
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
+#define PIXCMP InstrCount[1]
 // Add more macros here...
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
@@ -158,6 +236,182 @@ void ImageInit(void) { ///
 
 /// Image management functions
 
+//INICIO
+
+// The image pool
+//
+// Pipelines tend to create and destroy many images of the same size.
+// Instead of returning their memory to the system, ImageDestroy keeps
+// image structures and pixel buffers in a pool, from where they are
+// reused by the next allocations.
+// Pixel buffers are grouped in buckets by size class: bucket k holds
+// buffers with a capacity of 2^k bytes, so any buffer of a bucket can hold
+// any image whose size falls in that class.  Pages of a buffer beyond the
+// size actually used are never touched, so they cost no physical memory.
+// The pool is limited to POOLBYTES bytes and POOLBUFS buffers per bucket;
+// beyond that, memory is really freed.
+// The pool is protected by a mutex, as images may be created and destroyed
+// by several threads (see ImageLoadMany).
+
+#define POOLBUCKETS 48          // size classes: up to 2^47 bytes
+#define POOLMINCLASS 6          // smallest buffer: 64 bytes
+#define POOLBUFS 8              // maximum buffers kept per bucket
+#define POOLBYTES (256ul << 20) // maximum bytes kept in all buckets
+#define POOLHEADERS 64          // maximum image structures kept
+
+static struct {
+  pthread_mutex_t lock;
+  struct pixbuf* bucket[POOLBUCKETS]; // free buffers, linked by next
+  int nbufs[POOLBUCKETS];             // number of buffers in each bucket
+  size_t bytes;                       // total capacity of pooled buffers
+  Image header[POOLHEADERS];          // free image structures
+  int nheaders;
+} pool = { PTHREAD_MUTEX_INITIALIZER };
+
+// Size class of a buffer of n bytes: smallest k such that n <= 2^k.
+static int sizeClass(size_t n) {
+  int k = POOLMINCLASS;
+  while (k < POOLBUCKETS - 1 && ((size_t)1 << k) < n) k++;
+  return k;
+}
+
+// Get an image structure (uninitialized).
+// Returns NULL if memory is exhausted.
+static Image allocHeader(void) {
+  Image img = NULL;
+  pthread_mutex_lock(&pool.lock);
+  if (pool.nheaders > 0) img = pool.header[--pool.nheaders];
+  pthread_mutex_unlock(&pool.lock);
+  if (img == NULL) img = (Image)malloc(sizeof(struct image));
+  return img;
+}
+
+// Give an image structure back to the pool.
+static void freeHeader(Image img) {
+  pthread_mutex_lock(&pool.lock);
+  if (pool.nheaders < POOLHEADERS) {
+    pool.header[pool.nheaders++] = img;
+    img = NULL;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  free(img);
+}
+
+// Allocate an unshared buffer for the pixels of a width x height image,
+// with aligned rows, and set *stride accordingly.
+// The buffer comes from the pool, if one of the right class is available.
+// Returns NULL if memory is exhausted.
+static struct pixbuf* allocPixbuf(int width, int height, int* stride) {
+  *stride = (width + ROWALIGN - 1) / ROWALIGN * ROWALIGN;
+  size_t size = (size_t)*stride * height;
+  int k = sizeClass(size);  // empty images still get a 64-byte buffer
+
+  pthread_mutex_lock(&pool.lock);
+  struct pixbuf* buf = pool.bucket[k];
+  if (buf != NULL && buf->capacity >= size) {
+    pool.bucket[k] = buf->next;
+    pool.nbufs[k]--;
+    pool.bytes -= buf->capacity;
+  } else {
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (buf == NULL) {
+    buf = (struct pixbuf*)malloc(sizeof(struct pixbuf));
+    if (buf == NULL) {
+      return NULL;
+    }
+    buf->capacity = (k < POOLBUCKETS - 1) ? (size_t)1 << k : size;
+    if (posix_memalign(&buf->mem, ROWALIGN, buf->capacity) != 0) {
+      free(buf);
+      return NULL;
+    }
+  }
+  buf->refs = 1;
+  buf->mapsize = 0;
+  return buf;
+}
+
+// Drop one reference to buf, and release it if it was the last one:
+// allocated buffers go back to the pool while it has room.
+// Preserves errno.
+static void releasePixbuf(struct pixbuf* buf) {
+  // Views of one image may be destroyed from different threads
+  if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+  int savedErrno = errno;
+  if (buf->mapsize > 0) {
+    munmap(buf->mem, buf->mapsize); // Desfaz o mapeamento do ficheiro
+  } else {
+    int k = sizeClass(buf->capacity);
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nbufs[k] < POOLBUFS && pool.bytes + buf->capacity <= POOLBYTES) {
+      buf->next = pool.bucket[k];
+      pool.bucket[k] = buf;
+      pool.nbufs[k]++;
+      pool.bytes += buf->capacity;
+      buf = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (buf != NULL) free(buf->mem); // Libera a memória alocada para os pixels
+  }
+  free(buf);
+  errno = savedErrno;
+}
+
+/// Release all the memory kept in the image pool.
+/// Destroyed images leave their memory in a pool, to be reused by the next
+/// images created.  This gives that memory back to the system.
+/// Images that still exist are not affected.
+/// Should never fail, and should preserve global errno/errCause.
+void ImagePoolFlush(void) { ///
+  int savedErrno = errno;
+  pthread_mutex_lock(&pool.lock);
+  for (int k = 0; k < POOLBUCKETS; k++) {
+    while (pool.bucket[k] != NULL) {
+      struct pixbuf* buf = pool.bucket[k];
+      pool.bucket[k] = buf->next;
+      free(buf->mem);
+      free(buf);
+    }
+    pool.nbufs[k] = 0;
+  }
+  pool.bytes = 0;
+  while (pool.nheaders > 0) {
+    free(pool.header[--pool.nheaders]);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  errno = savedErrno;
+}
+
+// Allocate an image with uninitialized pixels.
+// Returns NULL if memory is exhausted.
+// Does not set errCause, so it is safe to call from several threads.
+static Image allocImage(int width, int height, uint8 maxval) {
+  // Obtém uma estrutura para a imagem
+  Image img = allocHeader();
+  if (img == NULL) {
+    return NULL;
+  }
+
+  // Inicializa os campos da estrutura da imagem
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+
+  // Aloca memória para o array de pixels (linhas alinhadas)
+  img->src = NULL;
+  img->integral = NULL;
+  img->pyramid = NULL;
+  img->buf = allocPixbuf(width, height, &img->stride);
+  if (img->buf == NULL) {
+    freeHeader(img); // Devolve a estrutura da imagem
+    return NULL;
+  }
+  img->pixel = (uint8*)img->buf->mem;
+  return img;
+}
+
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
@@ -166,41 +420,40 @@ void ImageInit(void) { ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-
-//INICIO
-
 Image ImageCreate(int width, int height, uint8 maxval) {                 
   assert(width >= 0);
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
 
-  // Aloca memória para a estrutura da imagem
-  Image img = (Image)malloc(sizeof(struct image));  
-
+  Image img = allocImage(width, height, maxval);
   if (img == NULL) {
     errCause = ("Failed to allocate memory in ImageCreate");
-    free(img);
     return NULL;
   }
 
-  // Inicializa os campos da estrutura da imagem
-  img->width = width;
-  img->height = height;
-  img->maxval = maxval;
+  // Inicializa os pixels para preto (0)
+  memset(img->pixel, 0, (size_t)img->stride * height);
 
-  // Aloca memória para o array de pixels
-  img->pixel = (uint8*)malloc(sizeof(uint8) * width * height);
-  if (img->pixel == NULL) {
-    errCause = ("Failed to allocate memory for pixel array");
-    free(img); // Libera a memória alocada para a estrutura da imagem
-    return NULL;
-  }
+  return img;
+}
 
-  // Inicializa os pixels para preto (0)
-  for (int i = 0; i < width * height; i++) {
-    img->pixel[i] = 0;
-  }
+/// Create a new image with undefined pixel levels.
+/// Like ImageCreate, but the pixels are not initialized, which saves a
+/// pass over the memory when the caller is going to set every pixel anyway.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateUninit(int width, int height, uint8 maxval) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
 
+  Image img = allocImage(width, height, maxval);
+  if (img == NULL) {
+    errCause = ("Failed to allocate memory in ImageCreateUninit");
+  }
   return img;
 }
 
@@ -215,13 +468,80 @@ void ImageDestroy(Image* imgp) {
   assert(imgp != NULL);
 
   if (*imgp != NULL) { // Verifica se a imagem não é NULL
-    free((*imgp)->pixel); // Libera a memória alocada para os pixels
-    free(*imgp); // Libera a memória alocada para a estrutura da imagem
+    releasePixbuf((*imgp)->buf); // Liberta os pixels, se não forem partilhados
+    free((*imgp)->src);
+    free((*imgp)->integral);
+    pyramidFree((*imgp)->pyramid);
+    freeHeader(*imgp); // Devolve a estrutura da imagem
     *imgp = NULL; // Define o ponteiro como NULL para evitar acesso acidental
   }
   // Se (*imgp) for NULL, nenhum passo adicional é necessário
 }
 
+// Prepare img to be modified in place.
+// If its pixels are shared with other images (views or parents), img gets
+// a private copy of them first, so that the others are not affected.
+// Returns nonzero on success.
+// On failure (memory exhausted), returns 0, sets errCause and img is not
+// changed.
+static int prepareWrite(Image img) {
+  if (img->src != NULL) {
+    // The pixels are going to differ from the file
+    free(img->src);
+    img->src = NULL;
+  }
+  if (img->integral != NULL) {
+    // The pixels are going to differ from the tables
+    free(img->integral);
+    img->integral = NULL;
+  }
+  if (img->pyramid != NULL) {
+    // The pixels are going to differ from the levels
+    pyramidFree(img->pyramid);
+    img->pyramid = NULL;
+  }
+  if (__atomic_load_n(&img->buf->refs, __ATOMIC_ACQUIRE) > 1) {
+    int stride;
+    struct pixbuf* buf = allocPixbuf(img->width, img->height, &stride);
+    if (!check( buf != NULL, "Failed to allocate private copy of shared image" )) {
+      return 0;
+    }
+    uint8* pixel = (uint8*)buf->mem;
+    for (int y = 0; y < img->height; y++) {
+      memcpy(pixel + (size_t)y * stride, img->pixel + (size_t)y * img->stride, img->width);
+    }
+    PIXMEM += 2ul * img->width * img->height;  // count pixel memory accesses
+    releasePixbuf(img->buf);
+    img->buf = buf;
+    img->pixel = pixel;
+    img->stride = stride;
+  }
+  return 1;
+}
+
+// Record that the pixels of img (just loaded) are stored in file path,
+// open as fd, starting at offset.  Only regular files are recorded.
+// This is just an optimization for ImageSave: if it fails, nothing is
+// recorded.  Does not set errCause and preserves errno.
+static void setSource(Image img, const char* path, int fd, off_t offset) {
+  int savedErrno = errno;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    struct source* src = (struct source*)malloc(sizeof(struct source) + strlen(path) + 1);
+    if (src != NULL) {
+      src->dev = st.st_dev;
+      src->ino = st.st_ino;
+      src->size = st.st_size;
+      src->mtime = st.st_mtim;
+      src->offset = offset;
+      strcpy(src->path, path);
+      free(img->src);
+      img->src = src;
+    }
+  }
+  errno = savedErrno;
+}
+
 /// PGM file operations
 
 // See also:
@@ -239,33 +559,67 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Read h rows of w pixels from f into pixel, with the given row stride.
+// Returns nonzero if all pixels were read.
+static int readRows(FILE* f, uint8* pixel, int w, int h, int stride) {
+  if (stride == w) {
+    size_t n = (size_t)w * h;
+    return fread(pixel, sizeof(uint8), n, f) == n;
+  }
+  for (int y = 0; y < h; y++) {
+    if (fread(pixel + (size_t)y * stride, sizeof(uint8), w, f) != (size_t)w) return 0;
+  }
+  return 1;
+}
+
+// Write h rows of w pixels, with the given row stride, from pixel to f.
+// Returns nonzero if all pixels were written.
+static int writeRows(FILE* f, const uint8* pixel, int w, int h, int stride) {
+  if (stride == w) {
+    size_t n = (size_t)w * h;
+    return fwrite(pixel, sizeof(uint8), n, f) == n;
+  }
+  for (int y = 0; y < h; y++) {
+    if (fwrite(pixel + (size_t)y * stride, sizeof(uint8), w, f) != (size_t)w) return 0;
+  }
+  return 1;
+}
+
+// Parse the header of a raw PGM file, leaving f positioned at the first
+// pixel.  On success, sets (*w, *h, *maxval) and returns nonzero.
+// On failure, returns 0 and sets errCause.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
-  int w, h;
+  int w = 0, h = 0;  // (counted below even if the header is invalid)
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &w, &h, &maxval) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = ImageCreateUninit(w, h, (uint8)maxval)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
+  check( readRows(f, img->pixel, w, h, img->stride) , "Reading pixels" );
   PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
 
   // Cleanup
@@ -273,139 +627,994 @@ Image ImageLoad(const char* filename) { ///
     errsave = errno;
     ImageDestroy(&img);
     errno = errsave;
+  } else {
+    long end = ftell(f);
+    if (end >= 0) setSource(img, filename, fileno(f), (off_t)end - (off_t)w*h);
   }
   if (f != NULL) fclose(f);
   return img;
 }
 
-/// Save image to PGM file.
-/// On success, returns nonzero.
-/// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(Image img, const char* filename) { ///
-  assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
-  FILE* f = NULL;
-
-  int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
-
-  // Cleanup
-  if (f != NULL) fclose(f);
-  return success;
+// Parse a raw PGM header held in memory: buf[0..len-1].
+// Accepts the same syntax as ImageLoad: magic number, width, height and
+// maxval separated by whitespace, with comment lines allowed before each
+// number, and a single whitespace character before the raster.
+// On success, sets (*w, *h, *maxval), sets *offset to the position of the
+// first pixel in buf, and returns NULL.
+// On failure, returns a string describing the failure cause
+// (errCause is not changed), and sets *more to nonzero if the header may
+// just continue past the end of buf.
+static const char* parseHeader(const uint8* buf, size_t len, int* w, int* h,
+                               int* maxval, size_t* offset, int* more) {
+  const char* fields[3] = { "Invalid width", "Invalid height", "Invalid maxval" };
+  int value[3];
+  size_t i = 0;
+
+  *more = 0;
+  if (len < 2) {
+    *more = len == 0 || buf[0] == 'P';
+    return "Invalid file format";
+  }
+  if (buf[0] != 'P' || buf[1] != '5') return "Invalid file format";
+  i = 2;
+  for (int f = 0; f < 3; f++) {
+    // Skip whitespace and comment lines
+    for (;;) {
+      while (i < len && isspace(buf[i])) i++;
+      if (i >= len || buf[i] != '#') break;
+      while (i < len && buf[i] != '\n') i++;
+    }
+    if (i >= len) {
+      *more = 1;
+      return fields[f];
+    }
+    if (!isdigit(buf[i])) return fields[f];
+    long v = 0;
+    while (i < len && isdigit(buf[i])) {
+      v = 10*v + (buf[i++] - '0');
+      if (v > INT32_MAX) return fields[f];
+    }
+    if (i >= len) {
+      *more = 1;  // the number, or the header, may go on
+      return fields[f];
+    }
+    value[f] = (int)v;
+  }
+  if (!(0 < value[2] && value[2] <= (int)PixMax)) return "Invalid maxval";
+  if (!isspace(buf[i])) return "Whitespace expected";
+  *w = value[0];
+  *h = value[1];
+  *maxval = value[2];
+  *offset = i + 1;
+  return NULL;
 }
 
+/// Load a raw PGM file by mapping it into memory.
+/// Like ImageLoad, but the pixels are not copied: the image refers directly
+/// to a private (copy-on-write) mapping of the file, so pages are only read
+/// when first accessed.  In-place operations are allowed and never change
+/// the file.  ImageDestroy releases the mapping.
+/// Files that cannot be mapped (pipes, devices) are read with ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) { ///
+  int w, h;
+  int maxval;
+  size_t offset;
+  const char* cause;
+  int more;
+  int fd = -1;
+  struct stat st;
+  void* map = MAP_FAILED;
+  struct pixbuf* buf = NULL;
+  Image img = NULL;
 
-/// Information queries
-
-/// These functions do not modify the image and never fail.
-
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
+  int success =
+  check( (fd = open(filename, O_RDONLY)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Stat failed" );
+  if (success && !S_ISREG(st.st_mode)) {
+    close(fd);
+    return ImageLoad(filename);
+  }
+  success = success &&
+  check( st.st_size > 0, "Invalid file format" ) &&
+  check( (map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fd, 0)) != MAP_FAILED, "Mapping failed" ) &&
+  // Parse PGM header
+  (cause = parseHeader(map, (size_t)st.st_size, &w, &h, &maxval, &offset, &more),
+   check( cause == NULL, cause )) &&
+  check( (size_t)st.st_size - offset >= (size_t)w*h, "Reading pixels" ) &&
+  check( (buf = (struct pixbuf*)malloc(sizeof(struct pixbuf))) != NULL,
+         "Failed to allocate memory in ImageLoadMapped" ) &&
+  check( (img = allocHeader()) != NULL,
+         "Failed to allocate memory in ImageLoadMapped" );
+
+  if (success) {
+    buf->refs = 1;
+    buf->mem = map;
+    buf->mapsize = (size_t)st.st_size;
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->stride = w;
+    img->pixel = (uint8*)map + offset;
+    img->buf = buf;
+    img->src = NULL;
+    img->integral = NULL;
+    img->pyramid = NULL;
+    setSource(img, filename, fd, (off_t)offset);
+  } else {
+    errsave = errno;
+    free(buf);
+    if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  }
+  if (fd >= 0) close(fd);
+  return img;
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+// Read up to n bytes at offset off of file fd into buf, stopping short
+// only at the end of the file.  Files that cannot seek (pipes, FIFOs) are
+// read sequentially instead, so off must then be the current position.
+// Returns the number of bytes read, or -1 on failure.
+static ssize_t preadSome(int fd, void* buf, size_t n, off_t off) {
+  uint8* p = (uint8*)buf;
+  size_t done = 0;
+  while (done < n) {
+    ssize_t k = pread(fd, p + done, n - done, off + (off_t)done);
+    if (k < 0 && errno == ESPIPE) k = read(fd, p + done, n - done);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) return -1;
+    if (k == 0) break;
+    done += (size_t)k;
+  }
+  return (ssize_t)done;
 }
 
-/// Get image maximum gray level
-int ImageMaxval(Image img) { ///
-  assert (img != NULL);
-  return img->maxval;
+// Read the pixels of img from position first (in raster order) on, from
+// file fd starting at offset off.  Rows are scattered directly into place,
+// many rows per system call.  As in preadSome, files that cannot seek are
+// read sequentially.
+// Returns nonzero on success, 0 on failure or premature end of file.
+static int preadPixels(int fd, Image img, size_t first, off_t off) {
+  struct iovec iov[64];
+  size_t w = (size_t)img->width;
+  size_t total = w * img->height;
+  size_t k = first;
+  while (k < total) {
+    int n = 0;
+    if ((size_t)img->stride == w) {
+      iov[n].iov_base = img->pixel + k;
+      iov[n++].iov_len = total - k;
+    } else {
+      for (size_t j = k; n < 64 && j < total; n++) {
+        size_t y = j / w, x = j % w;
+        iov[n].iov_base = img->pixel + y * img->stride + x;
+        iov[n].iov_len = w - x;
+        j += w - x;
+      }
+    }
+    ssize_t r = preadv(fd, iov, n, off);
+    if (r < 0 && errno == ESPIPE) r = readv(fd, iov, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    k += (size_t)r;
+    off += r;
+  }
+  return 1;
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) {             
-  assert(img != NULL);
-  assert(min != NULL);
-  assert(max != NULL);
-
-  int width = img->width;
-  int height = img->height;
-
-  //Caso imagem vazia
-  if ((width * height) == 0) {
-    *min = 0; 
-    *max = 0;
-    return;
+// Load one PGM file without stdio and without touching errCause.
+// The header is parsed from a buffer read at the start of the file, and
+// the pixels are read directly into the image.  Pipes and FIFOs are read
+// sequentially.
+// On failure, returns NULL, and sets *cause and errno.
+static Image loadOne(const char* filename, const char** cause) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    *cause = "Open failed";
+    return NULL;
+  }
+  Image img = NULL;
+  uint8 head[4096];
+  uint8* buf = head;
+  size_t cap = sizeof(head);
+  size_t len = 0;
+  int w, h, maxval;
+  size_t offset = 0;
+
+  // Read the first bytes of the file; grow the buffer only while the
+  // header (with its comments) may go on past the bytes read.
+  for (;;) {
+    ssize_t k = preadSome(fd, buf + len, cap - len, (off_t)len);
+    if (k < 0) {
+      *cause = "Read failed";
+      break;
+    }
+    len += (size_t)k;
+    int more;
+    *cause = parseHeader(buf, len, &w, &h, &maxval, &offset, &more);
+    if (*cause == NULL || !more || len < cap) break;  // done, invalid, or end of file
+    uint8* bigger = (uint8*)malloc(2 * cap);
+    if (bigger == NULL) {
+      *cause = "Failed to allocate memory in ImageLoadMany";
+      break;
+    }
+    memcpy(bigger, buf, len);
+    if (buf != head) free(buf);
+    buf = bigger;
+    cap *= 2;
+  }
+  if (*cause == NULL) {
+    size_t npix = (size_t)w * h;
+    size_t inbuf = len - offset;   // pixels already read with the header
+    if (inbuf > npix) inbuf = npix;
+    if ((img = allocImage(w, h, (uint8)maxval)) == NULL) {
+      *cause = "Failed to allocate memory in ImageLoadMany";
+    } else {
+      for (size_t k = 0; k < inbuf; k += (size_t)w) {
+        size_t n = (inbuf - k < (size_t)w) ? inbuf - k : (size_t)w;
+        memcpy(img->pixel + k / w * img->stride, buf + offset + k, n);
+      }
+      if (!preadPixels(fd, img, inbuf, (off_t)(offset + inbuf))) {
+        *cause = "Reading pixels";
+      } else {
+        setSource(img, filename, fd, (off_t)offset);
+      }
+    }
   }
 
-  // Inicializa min e max com os valores extremos possíveis
-  *min = PixMax;
-  *max = 0;
+  int savedErrno = errno;
+  if (*cause != NULL) ImageDestroy(&img);
+  if (buf != head) free(buf);
+  close(fd);
+  errno = savedErrno;
+  return img;
+}
 
-  // Itera sobre todos os pixels da imagem para encontrar min e max
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      uint8 pixelValue = ImageGetPixel(img, x, y);
+// Shared state of the workers of ImageLoadMany.
+struct loadJob {
+  const char** names;
+  int n;
+  Image* out;
+  const char** causes;
+  int* errnums;
+  int next;                 // next file to load
+  unsigned long pixels;     // pixels read by all workers
+  pthread_mutex_t lock;     // protects next and pixels
+};
 
-      // Atualiza min e max conforme necessário
-      *min = (pixelValue < *min) ? pixelValue : *min;
-      *max = (pixelValue > *max) ? pixelValue : *max;
-    }
+// Worker of ImageLoadMany: load files until none is left.
+static void* loadWorker(void* arg) {
+  struct loadJob* job = (struct loadJob*)arg;
+  unsigned long pixels = 0;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    int i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->n) break;
+
+    const char* cause = NULL;
+    errno = 0;
+    job->out[i] = loadOne(job->names[i], &cause);
+    if (job->causes != NULL) job->causes[i] = cause;
+    if (job->errnums != NULL) job->errnums[i] = (cause != NULL) ? errno : 0;
+    if (job->out[i] != NULL) pixels += (unsigned long)job->out[i]->width * job->out[i]->height;
   }
+  pthread_mutex_lock(&job->lock);
+  job->pixels += pixels;
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
 }
 
+/// Load many raw PGM files concurrently.
+///   names : array of n file names.
+///   out : array of n images, where the loaded images are stored.
+///   causes, errnums : optional arrays of n elements (may be NULL).
+/// Files are loaded by a pool of threads, one per available processor.
+/// If file names[i] is loaded, out[i] is the new image, causes[i] is NULL
+/// and errnums[i] is 0.  Otherwise, out[i] is NULL, causes[i] describes the
+/// failure cause and errnums[i] holds the corresponding errno value.
+/// Returns the number of images loaded.
+/// (The caller is responsible for destroying the returned images!)
+/// The global errno/errCause are preserved.
+int ImageLoadMany(const char** names, int n, Image* out,
+                  const char** causes, int* errnums) { ///
+  assert (n >= 0);
+  assert (n == 0 || (names != NULL && out != NULL));
+  int savedErrno = errno;
+  struct loadJob job = { names, n, out, causes, errnums, 0, 0ul };
+  pthread_mutex_init(&job.lock, NULL);
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = (ncpu < 1) ? 1 : (ncpu > 64) ? 64 : (int)ncpu;
+  if (nthreads > n) nthreads = n;
+  pthread_t tid[64];
+  int started = 0;
+  // The calling thread is one of the workers
+  while (started < nthreads - 1 &&
+         pthread_create(&tid[started], NULL, loadWorker, &job) == 0) {
+    started++;
+  }
+  loadWorker(&job);
+  for (int t = 0; t < started; t++) {
+    pthread_join(tid[t], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  PIXMEM += job.pixels;  // count pixel memory accesses
 
-/// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) { ///
-  assert (img != NULL);
-  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+  int loaded = 0;
+  for (int i = 0; i < n; i++) {
+    if (out[i] != NULL) loaded++;
+  }
+  errno = savedErrno;
+  return loaded;
 }
 
-/// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) {              
-  assert(img != NULL);
+// Is filename an existing file that is not a regular file (like
+// /dev/stdout)?  Those cannot be replaced by renaming, so they are written
+// directly.  Preserves errno.
+static int isSpecialFile(const char* filename) {
+  int savedErrno = errno;
+  struct stat st;
+  int special = stat(filename, &st) == 0 && !S_ISREG(st.st_mode);
+  errno = savedErrno;
+  return special;
+}
 
-  // Verifica se as coordenadas são não negativas
-  if (x < 0 || y < 0 || w <= 0 || h <= 0) {
-    return 0;  // Área inválida
+// The file that saving to filename replaces: the end of its chain of
+// symbolic links, so that the links are kept.  Sets *mode to the
+// permissions of that file, or to those of a new file if it does not
+// exist yet.  Returns a path (which the caller must free), or NULL if
+// memory is short.  Preserves errno, unless it fails.
+static char* saveTarget(const char* filename, mode_t* mode) {
+  int savedErrno = errno;
+  struct stat st;
+  char* path = realpath(filename, NULL);
+  if (path != NULL && stat(path, &st) == 0) {
+    *mode = st.st_mode & 07777;
+  } else {
+    free(path);
+    path = strdup(filename);
+    *mode = 0666 & ~fileMask;
   }
+  if (path != NULL) errno = savedErrno;
+  return path;
+}
 
-  // Verifica se as coordenadas estão dentro dos limites da imagem
-  if (x + w > img->width || y + h > img->height) {
-    return 0;  // Área ultrapassa os limites da imagem
+// Create a new temporary file with permissions mode in the same directory
+// as filename, to be renamed to filename when complete.  Sets *tmpname to
+// its name (which the caller must free).
+// Returns an open file descriptor, or -1 on failure.
+static int openTemp(const char* filename, mode_t mode, char** tmpname) {
+  const char* base = strrchr(filename, '/');
+  int dirlen = (base == NULL) ? 0 : (int)(base - filename) + 1;
+  base = filename + dirlen;
+  size_t n = strlen(filename) + 10;
+  *tmpname = (char*)malloc(n);
+  if (*tmpname == NULL) return -1;
+  snprintf(*tmpname, n, "%.*s.%s.XXXXXX", dirlen, filename, base);
+  int fd = mkstemp(*tmpname);
+  if (fd < 0) {
+    free(*tmpname);
+    *tmpname = NULL;
+    return -1;
   }
+  fchmod(fd, mode);
+  return fd;
+}
 
-  // Se ambas as condições anteriores forem atendidas, a área é válida
+// Write all the data described by iov[0..n-1] to fd, resuming after
+// partial writes.  Returns nonzero on success.
+static int writeAll(int fd, struct iovec* iov, int n) {
+  while (n > 0) {
+    ssize_t k = writev(fd, iov, n);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) return 0;
+    while (n > 0 && (size_t)k >= iov->iov_len) {
+      k -= (ssize_t)iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8*)iov->iov_base + k;
+      iov->iov_len -= (size_t)k;
+    }
+  }
   return 1;
 }
 
+// Write a PGM header and the pixels of img to fd.
+// Unpadded images go in a single writev call; padded rows are gathered
+// up to IOVROWS rows per call.  Returns nonzero on success.
+#define IOVROWS 1024
+static int writeImage(int fd, Image img, char* header, int hlen) {
+  struct iovec iov[IOVROWS];
+  int n = 0;
+  iov[n].iov_base = header;
+  iov[n++].iov_len = (size_t)hlen;
+  if (img->stride == img->width) {
+    iov[n].iov_base = img->pixel;
+    iov[n++].iov_len = (size_t)img->width * img->height;
+    return writeAll(fd, iov, n);
+  }
+  for (int y = 0; y < img->height; y++) {
+    iov[n].iov_base = img->pixel + (size_t)y * img->stride;
+    iov[n++].iov_len = (size_t)img->width;
+    if (n == IOVROWS || y == img->height - 1) {
+      if (!writeAll(fd, iov, n)) return 0;
+      n = 0;
+    }
+  }
+  return n == 0 || writeAll(fd, iov, n);
+}
 
-/// Pixel get & set operations
+// If img still holds exactly the pixels of its source file, and that file
+// has not changed, write the header to fd and copy the pixels directly
+// from file to file (copy_file_range, or else sendfile).
+// Returns nonzero if done; otherwise fd is left empty, to be written the
+// usual way (errno is preserved), or -1 if fd could not be emptied.
+static int copySource(int fd, Image img, char* header, int hlen) {
+  struct source* src = img->src;
+  struct stat st;
+  int savedErrno = errno;
+  if (src == NULL || stat(src->path, &st) != 0 ||
+      st.st_dev != src->dev || st.st_ino != src->ino || st.st_size != src->size ||
+      st.st_mtim.tv_sec != src->mtime.tv_sec || st.st_mtim.tv_nsec != src->mtime.tv_nsec) {
+    errno = savedErrno;
+    return 0;
+  }
+  int in = open(src->path, O_RDONLY);
+  if (in < 0) {
+    errno = savedErrno;
+    return 0;
+  }
+  struct iovec iov = { header, (size_t)hlen };
+  size_t left = (size_t)img->width * img->height;
+  off_t off = src->offset;
+  int ok = writeAll(fd, &iov, 1);
+  int usecopy = 1;
+  while (ok && left > 0) {
+    ssize_t k = usecopy ? copy_file_range(in, &off, fd, NULL, left, 0)
+                        : sendfile(fd, in, &off, left);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0 && usecopy && off == src->offset) {
+      usecopy = 0;  // not supported here: try sendfile
+      continue;
+    }
+    if (k <= 0) ok = 0;
+    else left -= (size_t)k;
+  }
+  close(in);
+  if (!ok) {
+    // Start over without the shortcut
+    ok = ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0;
+    if (!ok) return -1;
+    errno = savedErrno;
+    return 0;
+  }
+  errno = savedErrno;
+  return 1;
+}
 
-/// These are the primitive operations to access and modify a single pixel
-/// in the image.
-/// These are very simple, but fundamental operations, which may be used to 
-/// implement more complex operations.
+// Save img to filename, via a temporary file that is renamed over filename
+// only when complete.  If sync, the data is flushed to disk before the
+// rename, and the rename itself is flushed afterwards.
+// Existing non-regular files (like /dev/stdout) are written directly.
+static int saveImage(Image img, const char* filename, int sync) {
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+  char header[64];
+  int hlen = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n", w, h, maxval);
+  int direct = isSpecialFile(filename);
+  char* target = NULL;
+  mode_t mode;
+  char* tmpname = NULL;
+  int fd = -1;
+  int copied = 0;
 
-// Transform (x, y) coords into linear pixel index.
-// This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {                        
-  int index;
+  int success =
+  (direct ? check( (fd = open(filename, O_WRONLY | O_TRUNC)) >= 0, "Open failed" )
+          : check( (target = saveTarget(filename, &mode)) != NULL,
+                   "Failed to allocate memory in ImageSave" ) &&
+            check( (fd = openTemp(target, mode, &tmpname)) >= 0, "Open failed" )) &&
+  check( direct || (copied = copySource(fd, img, header, hlen)) >= 0, "Writing pixels failed" ) &&
+  check( copied || writeImage(fd, img, header, hlen), "Writing pixels failed" ) &&
+  check( !sync || fdatasync(fd) == 0, "Sync failed" );
+  if (copied <= 0) PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
 
-  // Verifica se as coordenadas estão dentro dos limites da imagem
-  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  // Cleanup
+  if (fd >= 0) {
+    // Keep the cause (and errno) of an earlier failure
+    errsave = errno;
+    int closed = close(fd) == 0;
+    if (!success) errno = errsave;
+    else if (!closed) success = check( 0, "Writing pixels failed" );
+  }
+  if (tmpname != NULL) {
+    success = success &&
+    check( rename(tmpname, target) == 0, "Rename failed" );
+    if (success && sync) {
+      // Make the new directory entry durable too
+      const char* slash = strrchr(target, '/');
+      char* dir = (slash == NULL) ? strdup(".") : strndup(target, (size_t)(slash - target) + 1);
+      int dfd = (dir == NULL) ? -1 : open(dir, O_RDONLY | O_DIRECTORY);
+      success = check( dfd >= 0 && fsync(dfd) == 0, "Sync failed" );
+      if (dfd >= 0) close(dfd);
+      free(dir);
+    }
+    if (!success) {
+      errsave = errno;
+      unlink(tmpname);
+      errno = errsave;
+    }
+    free(tmpname);
+  }
+  free(target);
+  return success;
+}
+
+/// Save image to PGM file.
+/// The file is written under a temporary name in the same directory and
+/// then atomically renamed, so other processes only ever see either the
+/// previous file or the complete new one.
+/// Symbolic links are followed, and an existing file keeps its permissions.
+/// An unmodified image loaded from a file that has not changed since is
+/// copied directly from that file, without going through memory.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left as it was.
+int ImageSave(Image img, const char* filename) { ///
+  return saveImage(img, filename, 0);
+}
+
+/// Save image to PGM file and make sure it reaches the disk.
+/// Like ImageSave, but the data and the new directory entry are flushed
+/// to disk (fdatasync/fsync) before returning, so that the file survives
+/// a system crash.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left as it was.
+int ImageSaveSync(Image img, const char* filename) { ///
+  return saveImage(img, filename, 1);
+}
+
+
+/// Streaming PGM operations
+
+// A reader (writer) keeps the open file and the image geometry, plus the
+// number of rows already transferred.  Only one band of rows needs to be in
+// memory at any time, so arbitrarily large files may be processed.
+struct imageReader {
+  FILE* f;
+  int width;
+  int height;
+  int maxval;
+  int row;      // next row to read
+};
+
+struct imageWriter {
+  FILE* f;
+  char* tmpname;    // temporary file name (or NULL if writing directly)
+  char* filename;   // final file name
+  int width;
+  int height;
+  int row;      // next row to write
+};
+
+/// Open a raw PGM file for reading by bands of rows.
+/// Only the header is read.
+/// On success, a new reader is returned.
+/// (The caller is responsible for closing the returned reader!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderOpen(const char* filename) { ///
+  FILE* f = NULL;
+  ImageReader r = NULL;
+  int w, h, maxval;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, &w, &h, &maxval) &&
+  check( (r = (ImageReader)malloc(sizeof(struct imageReader))) != NULL,
+         "Failed to allocate memory in ImageReaderOpen" );
+
+  if (!success) {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    errno = errsave;
+    return NULL;
+  }
+  r->f = f;
+  r->width = w;
+  r->height = h;
+  r->maxval = maxval;
+  r->row = 0;
+  return r;
+}
+
+/// Get the width of the image being read.
+int ImageReaderWidth(ImageReader r) { ///
+  assert (r != NULL);
+  return r->width;
+}
+
+/// Get the height of the image being read.
+int ImageReaderHeight(ImageReader r) { ///
+  assert (r != NULL);
+  return r->height;
+}
+
+/// Get the maximum gray level of the image being read.
+int ImageReaderMaxval(ImageReader r) { ///
+  assert (r != NULL);
+  return r->maxval;
+}
+
+/// Read the next band of rows.
+/// Fills the top rows of band with as many of the remaining rows as fit.
+/// Requires: band has the same width as the image being read.
+/// Returns the number of rows read: less than the band height only for the
+/// last band, and 0 once all rows have been read.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageReadBand(ImageReader r, Image band) { ///
+  assert (r != NULL);
+  assert (band != NULL);
+  assert (band->width == r->width);
+  int rows = r->height - r->row;
+  if (rows > band->height) rows = band->height;
+  size_t n = (size_t)rows * r->width;
+
+  if (!prepareWrite(band)) {
+    return -1;
+  }
+  if (!check( readRows(r->f, band->pixel, r->width, rows, band->stride), "Reading pixels" )) {
+    return -1;
+  }
+  PIXMEM += (unsigned long)n;  // count pixel memory accesses
+  r->row += rows;
+  return rows;
+}
+
+/// Close a reader and set (*rp) to NULL.
+/// If (*rp)==NULL, no operation is performed.
+void ImageReaderClose(ImageReader* rp) { ///
+  assert (rp != NULL);
+  if (*rp != NULL) {
+    errsave = errno;
+    fclose((*rp)->f);
+    free(*rp);
+    *rp = NULL;
+    errno = errsave;
+  }
+}
+
+/// Create a raw PGM file for writing by bands of rows.
+/// The file is written under a temporary name in the same directory and
+/// only replaces filename when the writer is closed after all rows.
+/// Symbolic links are followed, and an existing file keeps its permissions.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new writer is returned.
+/// (The caller is responsible for closing the returned writer!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterOpen(const char* filename, int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  FILE* f = NULL;
+  ImageWriter w = NULL;
+  char* tmpname = NULL;
+  char* name = NULL;
+  mode_t mode;
+  int direct = isSpecialFile(filename);
+  int fd = -1;
+
+  int success =
+  (direct ? check( (f = fopen(filename, "wb")) != NULL, "Open failed" )
+          : check( (name = saveTarget(filename, &mode)) != NULL,
+                   "Failed to allocate memory in ImageWriterOpen" ) &&
+            check( (fd = openTemp(name, mode, &tmpname)) >= 0, "Open failed" ) &&
+            check( (f = fdopen(fd, "wb")) != NULL, "Open failed" )) &&
+  check( fprintf(f, "P5\n%d %d\n%u\n", width, height, maxval) > 0, "Writing header failed" ) &&
+  check( (name != NULL || (name = strdup(filename)) != NULL) &&
+         (w = (ImageWriter)malloc(sizeof(struct imageWriter))) != NULL,
+         "Failed to allocate memory in ImageWriterOpen" );
+
+  if (!success) {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    else if (fd >= 0) close(fd);
+    if (tmpname != NULL) unlink(tmpname);
+    free(tmpname);
+    free(name);
+    errno = errsave;
+    return NULL;
+  }
+  w->f = f;
+  w->tmpname = tmpname;
+  w->filename = name;
+  w->width = width;
+  w->height = height;
+  w->row = 0;
+  return w;
+}
+
+/// Append the top rows of band to the file.
+/// Requires: band has the same width as the image being written,
+/// 0 <= rows <= band height, and no more rows than the remaining ones.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageWriteBand(ImageWriter w, Image band, int rows) { ///
+  assert (w != NULL);
+  assert (band != NULL);
+  assert (band->width == w->width);
+  assert (0 <= rows && rows <= band->height);
+  assert (rows <= w->height - w->row);
+  size_t n = (size_t)rows * w->width;
+
+  if (!check( writeRows(w->f, band->pixel, w->width, rows, band->stride), "Writing pixels failed" )) {
+    return 0;
+  }
+  PIXMEM += (unsigned long)n;  // count pixel memory accesses
+  w->row += rows;
+  return 1;
+}
+
+/// Close a writer and set (*wp) to NULL.
+/// If (*wp)==NULL, no operation is performed and nonzero is returned.
+/// Returns nonzero if all rows were written and the file was closed
+/// successfully.
+/// Otherwise, returns 0, errno/errCause are set appropriately, the
+/// partial file is removed and filename is left as it was.
+int ImageWriterClose(ImageWriter* wp) { ///
+  assert (wp != NULL);
+  ImageWriter w = *wp;
+  if (w == NULL) return 1;
+  int closed = fclose(w->f) == 0;
+  int success =
+  check( w->row == w->height, "Missing rows" ) &&
+  check( closed, "Closing file failed" );
+  if (w->tmpname != NULL) {
+    success = success &&
+    check( rename(w->tmpname, w->filename) == 0, "Rename failed" );
+    if (!success) {
+      errsave = errno;
+      unlink(w->tmpname);
+      errno = errsave;
+    }
+    free(w->tmpname);
+  }
+  free(w->filename);
+  free(w);
+  *wp = NULL;
+  return success;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+/// (Both are 0 for an empty image.)
+void ImageStats(Image img, uint8* min, uint8* max) { ///
+  assert(img != NULL);
+  assert(min != NULL);
+  assert(max != NULL);
+
+  int width = img->width;
+  int height = img->height;
+
+  //Caso imagem vazia
+  if ((width * height) == 0) {
+    *min = 0; 
+    *max = 0;
+    return;
+  }
+
+  // Local min and max, so they stay in registers
+  uint8 lo = PixMax;
+  uint8 hi = 0;
+  for (int y = 0; y < height; ++y) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    int x = 0;
+#ifdef __SSE2__
+    if (width >= 16) {
+      __m128i vlo = _mm_set1_epi8((char)lo);
+      __m128i vhi = _mm_set1_epi8((char)hi);
+      for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+        vlo = _mm_min_epu8(vlo, v);
+        vhi = _mm_max_epu8(vhi, v);
+      }
+      uint8 l[16], h[16];
+      _mm_storeu_si128((__m128i*)l, vlo);
+      _mm_storeu_si128((__m128i*)h, vhi);
+      for (int i = 0; i < 16; i++) {
+        lo = (l[i] < lo) ? l[i] : lo;
+        hi = (h[i] > hi) ? h[i] : hi;
+      }
+    }
+#endif
+    for (; x < width; ++x) {
+      lo = (row[x] < lo) ? row[x] : lo;
+      hi = (row[x] > hi) ? row[x] : hi;
+    }
+  }
+  *min = lo;
+  *max = hi;
+  PIXMEM += (unsigned long)width * height;  // count pixel memory accesses
+}
+
+// Number of pixels counted in the 32-bit sub-histograms before they are
+// added to the totals.
+#define HISTFLUSH (1u << 30)
+
+/// Histogram and stats
+/// Compute the histogram of gray levels of img into *hist, along with the
+/// number of pixels, minimum, maximum, sum and sum of squares of levels.
+/// The pixels are counted in one pass, into 4 interleaved sub-histograms,
+/// so that repeated levels do not stall on the same counter.
+/// For an empty image, all fields are 0.
+void ImageHistogram(Image img, ImageHist* hist) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  int width = img->width;
+  int height = img->height;
+  memset(hist, 0, sizeof(*hist));
+
+  uint32_t sub[4][256];
+  memset(sub, 0, sizeof(sub));
+  uint32_t counted = 0;
+  for (int y = 0; y < height; y++) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      uint64_t v;
+      memcpy(&v, row + x, 8);
+      sub[0][v & 0xff]++;
+      sub[1][(v >> 8) & 0xff]++;
+      sub[2][(v >> 16) & 0xff]++;
+      sub[3][(v >> 24) & 0xff]++;
+      sub[0][(v >> 32) & 0xff]++;
+      sub[1][(v >> 40) & 0xff]++;
+      sub[2][(v >> 48) & 0xff]++;
+      sub[3][v >> 56]++;
+    }
+    for (; x < width; x++) sub[x & 3][row[x]]++;
+    counted += (uint32_t)width;
+    if (counted >= HISTFLUSH || y == height - 1) {
+      for (int v = 0; v < 256; v++) {
+        hist->count[v] += (uint64_t)sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+      }
+      memset(sub, 0, sizeof(sub));
+      counted = 0;
+    }
+  }
+
+  // The remaining stats come from the histogram
+  int min = -1;
+  for (int v = 0; v < 256; v++) {
+    uint64_t c = hist->count[v];
+    if (c == 0) continue;
+    if (min < 0) min = v;
+    hist->max = (uint8)v;
+    hist->n += c;
+    hist->sum += c * v;
+    hist->sumsq += c * v * v;
+  }
+  hist->min = (min < 0) ? 0 : (uint8)min;
+  PIXMEM += (unsigned long)width * height;  // count pixel memory accesses
+}
+
+/// Mean gray level of a histogram (0 if empty).
+double ImageHistMean(const ImageHist* hist) { ///
+  assert (hist != NULL);
+  return (hist->n > 0) ? (double)hist->sum / hist->n : 0.0;
+}
+
+/// Standard deviation of the gray levels of a histogram (0 if empty).
+/// (Population standard deviation: the sum of squared deviations from
+/// the mean is divided by the number of pixels.)
+double ImageHistStddev(const ImageHist* hist) { ///
+  assert (hist != NULL);
+  if (hist->n == 0) return 0.0;
+  // (In long double, to limit the cancellation in n*sumsq - sum^2)
+  long double n = hist->n;
+  long double var = (n * hist->sumsq - (long double)hist->sum * hist->sum) / (n * n);
+  return (var > 0) ? sqrt((double)var) : 0.0;
+}
+
+/// Percentile p (in [0, 100]) of the gray levels of a histogram.
+/// Returns the lowest level such that at least p% of the pixels are at or
+/// below it (so p = 0 gives the minimum, p = 50 the median, p = 100 the
+/// maximum), or 0 if the histogram is empty.
+int ImageHistPercentile(const ImageHist* hist, double p) { ///
+  assert (hist != NULL);
+  assert (0.0 <= p && p <= 100.0);
+  if (hist->n == 0) return 0;
+  // Rank (1-based) of the pixel at the percentile
+  // (Multiplying first keeps p*n exact for whole p, so that, e.g., 7% of
+  // 100 pixels is rank 7, where p/100 = 0.07 would round up to rank 8)
+  uint64_t rank = (uint64_t)ceil(p * (double)hist->n / 100.0);
+  if (rank < 1) rank = 1;
+  if (rank > hist->n) rank = hist->n;
+  uint64_t count = 0;
+  int v = 0;
+  while (count + hist->count[v] < rank) count += hist->count[v++];
+  return v;
+}
+
+/// Check if pixel position (x,y) is inside img.
+int ImageValidPos(Image img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int ImageValidRect(Image img, int x, int y, int w, int h) {              
+  assert(img != NULL);
+
+  // Verifica se as coordenadas são não negativas
+  if (x < 0 || y < 0 || w <= 0 || h <= 0) {
+    return 0;  // Área inválida
+  }
+
+  // Verifica se as coordenadas estão dentro dos limites da imagem
+  if (x + w > img->width || y + h > img->height) {
+    return 0;  // Área ultrapassa os limites da imagem
+  }
+
+  // Se ambas as condições anteriores forem atendidas, a área é válida
+  return 1;
+}
+
+
+/// Pixel get & set operations
+
+/// These are the primitive operations to access and modify a single pixel
+/// in the image.
+/// These are very simple, but fundamental operations, which may be used to 
+/// implement more complex operations.
+
+// Transform (x, y) coords into linear pixel index.
+// This internal function is used in ImageGetPixel / ImageSetPixel. 
+// The returned index must satisfy (0 <= index < img->stride*img->height)
+static inline int G(Image img, int x, int y) {                        
+  int index;
+
+  // Verifica se as coordenadas estão dentro dos limites da imagem
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
 
   // Calcula o índice linear
-  index = y * img->width + x;
+  index = y * img->stride + x;
 
   // Verifica se o índice está dentro dos limites da imagem
-  assert (0 <= index && index < img->width * img->height);
+  assert (0 <= index && index < img->stride * img->height);
 
   return index;
 }
@@ -423,6 +1632,7 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
+  if (!prepareWrite(img)) return;
   PIXMEM += 1;  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 } 
@@ -432,86 +1642,116 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// except that an image sharing its pixels (see ImageView) first gets a
+/// private copy of them.
+/// They never fail, unless that copy cannot be allocated: then the image is
+/// left unchanged and errCause is set.
 
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) {                  
-  assert(img != NULL);
-
-  int size = img->width * img->height;
-//Percorrer os píxeis e calcular o negativo de cada pixel
-  for (int i = 0; i < size; ++i) {
-    img->pixel[i] = img->maxval - img->pixel[i];
-  }
+void ImageNegative(Image img) { ///
+  assert (img != NULL);
+  uint8 lut[256];
+  ImageLUTIdentity(lut);
+  ImageLUTNegative(lut, img->maxval);
+  ImageApplyLUT(img, lut);
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) {     
-    assert(img != NULL);
-
-    int width = img->width;
-    int height = img->height;
-    uint8 maxval = img->maxval;
-//Percorre cada pixel e se p valor do pixel for menor,
- //define como preto, senão define como branco
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            uint8 pixelValue = ImageGetPixel(img, x, y);
-
-            // Aplicar a lógica de limiar
-            if (pixelValue < thr) {
-                ImageSetPixel(img, x, y, 0);  // Define como preto
-            } else {
-                ImageSetPixel(img, x, y, maxval);  // Define como branco
-            }
-        }
-    }
+void ImageThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  uint8 lut[256];
+  ImageLUTIdentity(lut);
+  ImageLUTThreshold(lut, img->maxval, thr);
+  ImageApplyLUT(img, lut);
 }
 
-
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) {          
-  assert(img != NULL);
-  if(factor<0.0){factor=0.0;}
-  int width = ImageWidth(img);
-  int height = ImageHeight(img);
-  // Percorre todos os pixels da imagem
-  //for (int i = 0; i < img->width * img->height; ++i) {
-    // Calcula o novo valor do pixel multiplicando pelo fator
-    //uint8_t newPixelValue = (uint8_t)(img->pixel[i] * factor);
+void ImageBrighten(Image img, double factor) { ///
+  assert (img != NULL);
+  uint8 lut[256];
+  ImageLUTIdentity(lut);
+  ImageLUTBrighten(lut, img->maxval, factor);
+  ImageApplyLUT(img, lut);
+}
 
-    // Arredonda o valor para int
-    //int newPixelValueInt = (int)round(newPixelValue); 
-    // Atualize o valor do pixel na imagem, tendo em conta que
-    //não podem ter um valor maior a PixMax (255)
-    //img->pixel[i] = (newPixelValueInt > PixMax) ? PixMax : newPixelValueInt;
+/// Point operations as lookup tables.
 
+/// Any transformation of each pixel level that does not depend on the
+/// position of the pixel is described by a lookup table (LUT) with
+/// PixMax+1 entries: level v becomes lut[v].
+/// The ImageLUT* functions below apply a transformation to the entries of
+/// a LUT, so that calling several of them in sequence on the same LUT
+/// (starting from ImageLUTIdentity) builds the composition of the
+/// transformations, in that order, to be applied in a single pass by
+/// ImageApplyLUT.  User-supplied curves may be built directly.
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      // Obtenha o valor do pixel da imagem original
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-      
-      // Calcula o novo valor do pixel multiplicando pelo fator
-      
-      double aux = pixelValue * factor;
-      uint8_t newpixelValue = (uint8_t)round(aux);
-      if(newpixelValue>255){newpixelValue=255;}
+/// Set lut to the identity transformation.
+void ImageLUTIdentity(uint8 lut[256]) { ///
+  for (int v = 0; v <= PixMax; v++) lut[v] = (uint8)v;
+}
+
+/// Compose lut with the negative transformation (see ImageNegative).
+void ImageLUTNegative(uint8 lut[256], uint8 maxval) { ///
+  for (int v = 0; v <= PixMax; v++) lut[v] = (uint8)(maxval - lut[v]);
+}
+
+/// Compose lut with the threshold transformation (see ImageThreshold).
+void ImageLUTThreshold(uint8 lut[256], uint8 maxval, uint8 thr) { ///
+  for (int v = 0; v <= PixMax; v++) lut[v] = (lut[v] < thr) ? 0 : maxval;
+}
+
+/// Compose lut with the brighten transformation (see ImageBrighten).
+/// Levels are rounded to the nearest integer and saturated at maxval.
+/// Negative factors are taken as 0.
+void ImageLUTBrighten(uint8 lut[256], uint8 maxval, double factor) { ///
+  if (!(factor > 0.0)) factor = 0.0;
+  for (int v = 0; v <= PixMax; v++) {
+    double level = round(lut[v] * factor);
+    lut[v] = (level < maxval) ? (uint8)level : maxval;
+  }
+}
+
+/// Transform each pixel level v of img to lut[v].
+/// Like the other pixel transformations, this modifies img in-place.
+void ImageApplyLUT(Image img, const uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  int identity = 1;
+  for (int v = 0; v <= PixMax && identity; v++) identity = (lut[v] == v);
+  if (identity) return;   // nothing to do
+  if (!prepareWrite(img)) return;
 
-      // Defina o pixel na imagem rotacionada
-      ImageSetPixel(img, x, y, newpixelValue);
+  int width = img->width;
+  for (int y = 0; y < img->height; y++) {
+    uint8* row = img->pixel + (size_t)y * img->stride;
+    int x = 0;
+    // Unrolled gather: 8 pixels are loaded, looked up and stored at once
+    for (; x + 8 <= width; x += 8) {
+      uint64_t p;
+      memcpy(&p, row + x, 8);
+      uint64_t q =
+        (uint64_t)lut[p & 0xff] |
+        (uint64_t)lut[(p >> 8) & 0xff] << 8 |
+        (uint64_t)lut[(p >> 16) & 0xff] << 16 |
+        (uint64_t)lut[(p >> 24) & 0xff] << 24 |
+        (uint64_t)lut[(p >> 32) & 0xff] << 32 |
+        (uint64_t)lut[(p >> 40) & 0xff] << 40 |
+        (uint64_t)lut[(p >> 48) & 0xff] << 48 |
+        (uint64_t)lut[p >> 56] << 56;
+      memcpy(row + x, &q, 8);
     }
+    for (; x < width; x++) row[x] = lut[row[x]];
   }
-  //
+  PIXMEM += 2ul * width * img->height;  // count pixel memory accesses
 }
 
 
@@ -528,6 +1768,94 @@ void ImageBrighten(Image img, double factor) {
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Geometric transformations move pixels in bulk, block by block.
+//
+// Rotations are transpositions with some rows or columns reversed,
+// which is expressed by passing row pointers and (possibly negative)
+// row strides.  The transposition is done in TILE x TILE blocks, so that
+// both the rows read and the rows written stay in cache while a block is
+// processed, and each block is done in 16x16 pieces with SSE2 shuffles.
+
+#define TILE 64
+
+#ifdef __SSE2__
+// Transpose a 16x16 block: dst[x*dstride + y] = src[y*sstride + x].
+static void transpose16(const uint8* src, ptrdiff_t sstride,
+                        uint8* dst, ptrdiff_t dstride) {
+  __m128i a[16], b[16];
+  for (int i = 0; i < 16; i++) {
+    a[i] = _mm_loadu_si128((const __m128i*)(src + i * sstride));
+  }
+  // Each pass interleaves rows i and i+8 byte by byte, which rotates the
+  // 8 bits of (row, column) one position; 4 passes swap row and column.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < 8; i++) {
+      b[2*i] = _mm_unpacklo_epi8(a[i], a[i+8]);
+      b[2*i+1] = _mm_unpackhi_epi8(a[i], a[i+8]);
+    }
+    for (int i = 0; i < 8; i++) {
+      a[2*i] = _mm_unpacklo_epi8(b[i], b[i+8]);
+      a[2*i+1] = _mm_unpackhi_epi8(b[i], b[i+8]);
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    _mm_storeu_si128((__m128i*)(dst + i * dstride), a[i]);
+  }
+}
+
+// Reverse the order of the 16 bytes in v.
+static inline __m128i reverse16(__m128i v) {
+  v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+// Transpose a w x h block: dst[x*dstride + y] = src[y*sstride + x].
+static void transposeBlock(const uint8* src, ptrdiff_t sstride,
+                           uint8* dst, ptrdiff_t dstride, int w, int h) {
+  int y = 0;
+#ifdef __SSE2__
+  for (; y + 16 <= h; y += 16) {
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+      transpose16(src + y * sstride + x, sstride, dst + x * dstride + y, dstride);
+    }
+    for (; x < w; x++) {
+      for (int k = y; k < y + 16; k++) dst[x * dstride + k] = src[k * sstride + x];
+    }
+  }
+#endif
+  for (; y < h; y++) {
+    for (int x = 0; x < w; x++) dst[x * dstride + y] = src[y * sstride + x];
+  }
+}
+
+// Transpose a whole width x height image, tile by tile.
+static void transposeImage(const uint8* src, ptrdiff_t sstride,
+                           uint8* dst, ptrdiff_t dstride, int width, int height) {
+  for (int y = 0; y < height; y += TILE) {
+    int h = (height - y < TILE) ? height - y : TILE;
+    for (int x = 0; x < width; x += TILE) {
+      int w = (width - x < TILE) ? width - x : TILE;
+      transposeBlock(src + y * sstride + x, sstride, dst + x * dstride + y, dstride, w, h);
+    }
+  }
+}
+
+// Copy the n pixels of row src to dst in reverse order.
+static void reverseRow(const uint8* src, uint8* dst, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + n - 16 - i));
+    _mm_storeu_si128((__m128i*)(dst + i), reverse16(v));
+  }
+#endif
+  for (; i < n; i++) dst[i] = src[n - 1 - i];
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -536,404 +1864,3198 @@ void ImageBrighten(Image img, double factor) {
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate(Image img) { ///
+  assert (img != NULL);
+  int width = img->width;
+  int height = img->height;
 
-Image ImageRotate(Image img) {                  
-  assert(img != NULL);
-
-  // Obter as dimensões da imagem original
-  int width = ImageWidth(img);
-  int height = ImageHeight(img);
-
-  //Nova imagem para armazenar a imagem rotacionada (width e height trocadas)
-  Image rotatedImage = ImageCreate(height, width, ImageMaxval(img));
-
-  // Verifica se a criação da nova imagem foi bem-sucedida
-  if (rotatedImage == NULL) {
+  // Nova imagem para armazenar a imagem rodada (width e height trocadas)
+  Image rotated = ImageCreateUninit(height, width, img->maxval);
+  if (rotated == NULL) {
     errCause = "Memory allocation error (ImageRotate)";
     return NULL;
   }
 
-  // Faça a rotação anti-horária de 90 graus
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
+  // O pixel (x, y) vai para (y, width-1-x): a coluna x passa a ser a
+  // linha width-1-x, ou seja, transpor com as linhas de destino invertidas
+  // (An empty image has no last row to start from)
+  if (width > 0 && height > 0) {
+    ptrdiff_t stride = rotated->stride;
+    uint8* last = rotated->pixel + (size_t)(width - 1) * stride;
+    transposeImage(img->pixel, img->stride, last, -stride, width, height);
+  }
+  PIXMEM += 2ul * width * height;  // count pixel memory accesses
 
-      // Calcule as coordenadas na imagem rotacionada
-      int rotatedX = y;
-      int rotatedY = width - x -1;
+  return rotated;
+}
 
-      // Obtenha o valor do pixel da imagem original
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-      // Defina o pixel na imagem rotacionada
-      ImageSetPixel(rotatedImage, rotatedX, rotatedY, pixelValue);
+/// Rotate an image by 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  int width = img->width;
+  int height = img->height;
+
+  Image rotated = ImageCreateUninit(width, height, img->maxval);
+  if (rotated == NULL) {
+    errCause = "Memory allocation error (ImageRotate180)";
+    return NULL;
+  }
+
+  // A linha y vai, invertida, para a linha height-1-y
+  for (int y = 0; y < height; y++) {
+    reverseRow(img->pixel + (size_t)y * img->stride,
+               rotated->pixel + (size_t)(height - 1 - y) * rotated->stride, width);
+  }
+  PIXMEM += 2ul * width * height;  // count pixel memory accesses
+
+  return rotated;
+}
+
+/// Rotate an image by 90 degrees clockwise (270 anti-clockwise).
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) { ///
+  assert (img != NULL);
+  int width = img->width;
+  int height = img->height;
+
+  Image rotated = ImageCreateUninit(height, width, img->maxval);
+  if (rotated == NULL) {
+    errCause = "Memory allocation error (ImageRotate270)";
+    return NULL;
+  }
+
+  // O pixel (x, y) vai para (height-1-y, x): transpor lendo as linhas
+  // de origem de baixo para cima
+  if (width > 0 && height > 0) {
+    ptrdiff_t stride = img->stride;
+    const uint8* last = img->pixel + (size_t)(height - 1) * stride;
+    transposeImage(last, -stride, rotated->pixel, rotated->stride, width, height);
+  }
+  PIXMEM += 2ul * width * height;  // count pixel memory accesses
+
+  return rotated;
+}
+
+
+/// Mirror an image = flip left-right.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMirror(Image img) { ///
+  assert (img != NULL);
+
+  // Cria uma nova imagem com as mesmas dimensões e valores máximos
+  Image mirroredImg = ImageCreateUninit(img->width, img->height, img->maxval);
+  if (mirroredImg == NULL) {
+    errCause = "Memory allocation error (ImageMirror)";
+    return NULL;
+  }
+
+  // Cada linha é copiada por ordem inversa
+  for (int y = 0; y < img->height; y++) {
+    reverseRow(img->pixel + (size_t)y * img->stride,
+               mirroredImg->pixel + (size_t)y * mirroredImg->stride, img->width);
+  }
+  PIXMEM += 2ul * img->width * img->height;  // count pixel memory accesses
+
+  return mirroredImg;
+}
+
+/// Crop a rectangular subimage from img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+                                                                    
+
+Image ImageCrop(Image img, int x, int y, int w, int h) {
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, w, h));
+
+  // Cria uma nova imagem para armazenar a subimagem cortada
+  Image croppedImg = ImageCreateUninit(w, h, img->maxval);
+  if (croppedImg == NULL) {
+    errCause = "Memory allocation error (ImageCrop)";
+    return NULL;
+  }
+
+  // Copia as linhas da subimagem para a nova imagem
+  for (int dy = 0; dy < h; dy++) {
+    memcpy(croppedImg->pixel + (size_t)dy * croppedImg->stride,
+           img->pixel + (size_t)(y + dy) * img->stride + x, w);
+  }
+  PIXMEM += 2ul * w * h;  // count pixel memory accesses
+
+  return croppedImg;
+}
+
+
+/// Create a view of a rectangular subimage of img.
+/// The rectangle is specified as in ImageCrop.
+/// The view shares the pixels of img: no pixels are copied.
+/// Modifying either the view or img in place gives the modified image
+/// a private copy of its pixels first (copy-on-write), so the result
+/// always behaves as an independent copy, like the result of ImageCrop.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+
+  Image view = allocHeader();
+  if (!check( view != NULL, "Failed to allocate memory in ImageView" )) {
+    return NULL;
+  }
+  view->width = w;
+  view->height = h;
+  view->maxval = img->maxval;
+  view->stride = img->stride;
+  view->pixel = img->pixel + (size_t)y * img->stride + x;
+  view->buf = img->buf;
+  __atomic_fetch_add(&view->buf->refs, 1, __ATOMIC_RELAXED);
+  view->src = NULL;
+  view->integral = NULL;
+  view->pyramid = NULL;
+  return view;
+}
+
+
+/// Operations on two images
+
+/// Paste an image into a larger image.
+/// Paste img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void ImagePaste(Image img1, int x, int y, Image img2) {                       
+  assert(img1 != NULL); 
+  assert(img2 != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!prepareWrite(img1)) return;
+
+  // Copiar as linhas de img2 para img1 na posição adequada
+  for (int newY = 0; newY < img2->height; ++newY) {
+    memcpy(img1->pixel + (size_t)(y + newY) * img1->stride + x,
+           img2->pixel + (size_t)newY * img2->stride, img2->width);
+  }
+  PIXMEM += 2ul * img2->width * img2->height;  // count pixel memory accesses
+}
+
+
+// Blending in fixed point.
+// The result of blending p2 into p1 is round((1-alpha)*p1 + alpha*p2),
+// which is p1 + alpha*(p2-p1), or p2 + (1-alpha)*(p1-p2) when alpha >= 0.5
+// (then 1-alpha is exact).  That is computed with a weight of 15
+// fractional bits, as (base << 15) + (other-base)*weight, in 32 bits.
+// The weight is off by at most 2^-16, so the error is below 255*2^-16:
+// results are exact unless the fixed-point value falls within BLENDBAND
+// of a half level, and only those pixels are redone in double, so that
+// the rounding is exactly that of the formula above.
+
+#define BLENDBAND 160   // > 255*2^-16 levels, in units of 2^-15 levels
+
+struct blendWeights {
+  double alpha;
+  int fixed;    // can the weight be used?
+  int swap;     // base is p2 and other is p1 (alpha >= 0.5)?
+  int weight;   // (swap ? 1-alpha : alpha) * 2^15
+  uint8 maxval; // results saturate to [0, maxval]
+};
+
+static void blendWeightsInit(struct blendWeights* bw, double alpha, uint8 maxval) {
+  bw->alpha = alpha;
+  bw->maxval = maxval;
+  bw->swap = (alpha >= 0.5);
+  double t = bw->swap ? 1.0 - alpha : alpha;
+  bw->fixed = (t >= -1.0 && t * 32768.0 <= 32767.0);
+  bw->weight = bw->fixed ? (int)lround(t * 32768.0) : 0;
+}
+
+// Blend with the double formula, saturated.
+static inline uint8 blendExact(uint8 p1, uint8 p2, const struct blendWeights* bw) {
+  double v = round((1.0 - bw->alpha) * p1 + bw->alpha * p2);
+  return !(v > 0.0) ? 0 : (v >= bw->maxval) ? bw->maxval : (uint8)v;
+}
+
+static inline uint8 blendPixel(uint8 p1, uint8 p2, const struct blendWeights* bw) {
+  if (!bw->fixed) return blendExact(p1, p2, bw);
+  int base = bw->swap ? p2 : p1;
+  int other = bw->swap ? p1 : p2;
+  int32_t v = base * 32768 + (other - base) * bw->weight;
+  int frac = v & 0x7fff;
+  if (frac >= 16384 - BLENDBAND && frac <= 16384 + BLENDBAND) return blendExact(p1, p2, bw);
+  int r = (v + 16384) >> 15;
+  return (r <= 0) ? 0 : (r >= bw->maxval) ? bw->maxval : (uint8)r;
+}
+
+// Blend the n pixels of src into dst.
+static void blendRow(uint8* dst, const uint8* src, int n, const struct blendWeights* bw) {
+  int x = 0;
+#ifdef __SSE2__
+  if (bw->fixed) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight = _mm_set1_epi16((short)bw->weight);
+    const __m128i half = _mm_set1_epi32(16384);
+    const __m128i fracMask = _mm_set1_epi32(0x7fff);
+    const __m128i bandLo = _mm_set1_epi32(16384 - BLENDBAND - 1);
+    const __m128i bandHi = _mm_set1_epi32(16384 + BLENDBAND + 1);
+    const __m128i maxval = _mm_set1_epi8((char)bw->maxval);
+    for (; x + 16 <= n; x += 16) {
+      __m128i p1 = _mm_loadu_si128((const __m128i*)(dst + x));
+      __m128i p2 = _mm_loadu_si128((const __m128i*)(src + x));
+      __m128i base = bw->swap ? p2 : p1;
+      __m128i other = bw->swap ? p1 : p2;
+      __m128i r16[2];
+      __m128i amb = zero;
+      for (int k = 0; k < 2; k++) {
+        __m128i b = k ? _mm_unpackhi_epi8(base, zero) : _mm_unpacklo_epi8(base, zero);
+        __m128i o = k ? _mm_unpackhi_epi8(other, zero) : _mm_unpacklo_epi8(other, zero);
+        __m128i d = _mm_sub_epi16(o, b);
+        __m128i lo = _mm_mullo_epi16(d, weight);
+        __m128i hi = _mm_mulhi_epi16(d, weight);
+        __m128i r32[2];
+        for (int j = 0; j < 2; j++) {
+          __m128i prod = j ? _mm_unpackhi_epi16(lo, hi) : _mm_unpacklo_epi16(lo, hi);
+          __m128i b32 = j ? _mm_unpackhi_epi16(b, zero) : _mm_unpacklo_epi16(b, zero);
+          __m128i v = _mm_add_epi32(_mm_slli_epi32(b32, 15), prod);
+          __m128i frac = _mm_and_si128(v, fracMask);
+          amb = _mm_or_si128(amb, _mm_and_si128(_mm_cmpgt_epi32(frac, bandLo),
+                                                _mm_cmplt_epi32(frac, bandHi)));
+          r32[j] = _mm_srai_epi32(_mm_add_epi32(v, half), 15);
+        }
+        r16[k] = _mm_packs_epi32(r32[0], r32[1]);
+      }
+      __m128i r = _mm_min_epu8(_mm_packus_epi16(r16[0], r16[1]), maxval);
+      _mm_storeu_si128((__m128i*)(dst + x), r);
+      if (_mm_movemask_epi8(amb) != 0) {
+        // Rare: redo the pixels near a half level
+        uint8 q1[16];
+        _mm_storeu_si128((__m128i*)q1, p1);
+        for (int i = 0; i < 16; i++) dst[x + i] = blendPixel(q1[i], src[x + i], bw);
+      }
+    }
+  }
+#endif
+  for (; x < n; x++) dst[x] = blendPixel(dst[x], src[x], bw);
+}
+
+/// Blend an image into a larger image.
+/// Blend img2 into position (x, y) of img1.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y).
+/// alpha usually is in [0.0, 1.0], but values outside that interval
+/// may provide interesting effects.  Over/underflows saturate to
+/// [0, maxval] of img1.
+/// Each pixel becomes round((1-alpha)*pixel1 + alpha*pixel2), computed in
+/// fixed point, a row at a time.
+void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!prepareWrite(img1)) return;
+
+  struct blendWeights bw;
+  blendWeightsInit(&bw, alpha, img1->maxval);
+  for (int i = 0; i < img2->height; ++i) {
+    blendRow(img1->pixel + (size_t)(y + i) * img1->stride + x,
+             img2->pixel + (size_t)i * img2->stride, img2->width, &bw);
+  }
+  PIXMEM += 3ul * img2->width * img2->height;  // count pixel memory accesses
+}
+
+
+// Compositing.
+// Each destination row is built in one pass: the layers that cover the row
+// are kept in an active list (ordered bottom to top), their spans are
+// clipped top-down against the union of the opaque spans above them, and
+// the visible pieces are then applied bottom-up.
+
+// A visible piece [x1, x2) of layer k on the current row.
+struct compPiece {
+  int layer;
+  int x1, x2;
+};
+
+// Is layer l pasted (copied) rather than blended?
+static inline int layerOpaque(const ImageLayer* l) {
+  return l->mask == NULL && l->alpha == 1.0;
+}
+
+// Subtract the sorted disjoint intervals cover[0..nc) from [x1, x2),
+// appending the remaining pieces of layer k to pieces (np < limit).
+// If there is no room for more than limit pieces, the rest of the span is
+// appended whole: drawing a covered part is harmless, as it is drawn over.
+// Returns the new number of pieces.
+static int compVisible(const int (*cover)[2], int nc, int x1, int x2, int k,
+                       struct compPiece* pieces, int np, int limit) {
+  for (int i = 0; i < nc && x1 < x2; i++) {
+    if (cover[i][1] <= x1) continue;
+    if (cover[i][0] >= x2 || np + 1 >= limit) break;
+    if (cover[i][0] > x1) pieces[np++] = (struct compPiece){k, x1, cover[i][0]};
+    x1 = cover[i][1];
+  }
+  if (x1 < x2) pieces[np++] = (struct compPiece){k, x1, x2};
+  return np;
+}
+
+// Add [x1, x2) to the sorted disjoint intervals cover[0..nc), merging.
+// Returns the new number of intervals.
+static int compCover(int (*cover)[2], int nc, int x1, int x2) {
+  int i = 0;
+  while (i < nc && cover[i][1] < x1) i++;
+  int j = i;
+  while (j < nc && cover[j][0] <= x2) {
+    if (cover[j][0] < x1) x1 = cover[j][0];
+    if (cover[j][1] > x2) x2 = cover[j][1];
+    j++;
+  }
+  // cover[i..j) merge into [x1, x2)
+  memmove(cover + i + 1, cover + j, (size_t)(nc - j) * sizeof(cover[0]));
+  cover[i][0] = x1;
+  cover[i][1] = x2;
+  return nc - (j - i) + 1;
+}
+
+// Order of layers a and b by top row.
+static int compLayerTop(const ImageLayer* layers, int a, int b) {
+  return (layers[a].y != layers[b].y) ? layers[a].y - layers[b].y : a - b;
+}
+
+/// Composite several layers into an image.
+/// Layers are applied in order, layers[0] at the bottom and layers[n-1] on
+/// top.  Each layer places its image img with the top left corner at
+/// (x, y) of dst; only the part inside dst is used.
+/// A layer with alpha 1.0 and no mask is pasted, like ImagePaste;
+/// otherwise it is blended, like ImageBlend, with the given alpha.
+/// If mask is not NULL, it must have the size of img, and the alpha of
+/// each pixel is scaled by mask level / mask maxval.
+/// The result is the same as pasting or blending each layer in turn, but
+/// dst is built in a single pass over its rows, visiting only the layers
+/// that cover each row, and skipping the parts of layers that are
+/// covered by pasted layers above them.
+/// Requires: no layer image or mask is dst itself.
+/// This modifies dst in-place.
+/// If the working memory cannot be allocated, dst is left unchanged and
+/// errCause is set.
+void ImageComposite(Image dst, const ImageLayer* layers, int n) { ///
+  assert (dst != NULL);
+  assert (n >= 0);
+  assert (n == 0 || layers != NULL);
+  for (int k = 0; k < n; k++) {
+    assert (layers[k].img != NULL && layers[k].img != dst);
+    assert (layers[k].mask == NULL || (layers[k].mask != dst &&
+            layers[k].mask->width == layers[k].img->width &&
+            layers[k].mask->height == layers[k].img->height));
+  }
+  if (n == 0) return;
+
+  // Working memory: the layer order by top row, the active list, the
+  // opaque intervals and visible pieces of one row, and blending weights
+  // (one per mask level for masked layers).
+  int nmasked = 0;
+  for (int k = 0; k < n; k++) nmasked += (layers[k].mask != NULL);
+  int* order = malloc((size_t)n * 4 * sizeof(int));
+  int (*cover)[2] = malloc((size_t)n * sizeof(cover[0]));
+  int npieces = 4 * n;
+  struct compPiece* pieces = malloc((size_t)npieces * sizeof(struct compPiece));
+  struct blendWeights* weights = malloc(((size_t)n + (size_t)nmasked * 256) *
+                                        sizeof(struct blendWeights));
+  if (!check( order != NULL && cover != NULL && pieces != NULL && weights != NULL,
+              "Failed to allocate memory in ImageComposite" ) ||
+      !prepareWrite(dst)) {
+    free(order);
+    free(cover);
+    free(pieces);
+    free(weights);
+    return;
+  }
+  int* active = order + n;
+  int* levels = active + n;   // index of the mask weights of each layer
+  int* next = levels + n;     // (scratch for merging active)
+
+  struct blendWeights* maskWeights = weights + n;
+  int m = 0;
+  for (int k = 0; k < n; k++) {
+    blendWeightsInit(&weights[k], layers[k].alpha, dst->maxval);
+    levels[k] = -1;
+    Image mask = layers[k].mask;
+    if (mask != NULL) {
+      levels[k] = m;
+      for (int v = 0; v < 256; v++) {
+        double scale = (mask->maxval > 0 && v <= mask->maxval) ? (double)v / mask->maxval : 1.0;
+        blendWeightsInit(&maskWeights[m * 256 + v], layers[k].alpha * scale, dst->maxval);
+      }
+      m++;
+    }
+  }
+
+  // Insertion sort of the layers by top row (n is usually small)
+  for (int k = 0; k < n; k++) {
+    int j = k;
+    while (j > 0 && compLayerTop(layers, order[j - 1], k) > 0) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = k;
+  }
+
+  int width = dst->width;
+  int height = dst->height;
+  int first = 0;     // next layer of order to become active
+  int nactive = 0;   // active layers, bottom to top
+  unsigned long accesses = 0;
+  int y0 = (layers[order[0]].y > 0) ? layers[order[0]].y : 0;
+  for (int y = y0; y < height; y++) {
+    // Update the active list: drop the layers above row y, add the new ones
+    int na = 0;
+    for (int i = 0; i < nactive; i++) {
+      const ImageLayer* l = &layers[active[i]];
+      if (y < l->y + l->img->height) active[na++] = active[i];
+    }
+    nactive = na;
+    int added = 0;
+    while (first < n && layers[order[first]].y <= y) {
+      const ImageLayer* l = &layers[order[first]];
+      if (y < l->y + l->img->height && l->x < width && l->x + l->img->width > 0) {
+        next[added++] = order[first];
+      }
+      first++;
+    }
+    if (added > 0) {
+      // Merge the new layers (in layer order) into active
+      for (int i = 1; i < added; i++) {
+        int v = next[i], j = i;
+        while (j > 0 && next[j - 1] > v) { next[j] = next[j - 1]; j--; }
+        next[j] = v;
+      }
+      int i = nactive - 1, j = added - 1;
+      nactive += added;
+      for (int t = nactive - 1; t >= 0; t--) {
+        active[t] = (j < 0 || (i >= 0 && active[i] > next[j])) ? active[i--] : next[j--];
+      }
+    }
+    if (nactive == 0) {
+      if (first == n) break;
+      y = layers[order[first]].y - 1;   // skip to the next layer
+      continue;
+    }
+
+    // Visible pieces, top-down
+    int nc = 0;
+    int np = 0;
+    for (int i = nactive - 1; i >= 0; i--) {
+      int k = active[i];
+      const ImageLayer* l = &layers[k];
+      int x1 = (l->x > 0) ? l->x : 0;
+      int x2 = (l->x + l->img->width < width) ? l->x + l->img->width : width;
+      // (leaving a piece for each of the i layers below)
+      np = compVisible((const int (*)[2])cover, nc, x1, x2, k, pieces, np, npieces - i);
+      if (layerOpaque(l)) nc = compCover(cover, nc, x1, x2);
+      if (nc == 1 && cover[0][0] == 0 && cover[0][1] == width) break;  // all covered
+    }
+
+    // Apply them, bottom-up
+    uint8* row = dst->pixel + (size_t)y * dst->stride;
+    for (int p = np - 1; p >= 0; p--) {
+      const ImageLayer* l = &layers[pieces[p].layer];
+      int x1 = pieces[p].x1;
+      int len = pieces[p].x2 - x1;
+      const uint8* src = l->img->pixel + (size_t)(y - l->y) * l->img->stride + (x1 - l->x);
+      if (layerOpaque(l)) {
+        memcpy(row + x1, src, len);
+        accesses += 2ul * len;
+      } else if (l->mask == NULL) {
+        blendRow(row + x1, src, len, &weights[pieces[p].layer]);
+        accesses += 3ul * len;
+      } else {
+        const uint8* mrow = l->mask->pixel + (size_t)(y - l->y) * l->mask->stride + (x1 - l->x);
+        const struct blendWeights* bw = &maskWeights[levels[pieces[p].layer] * 256];
+        for (int i = 0; i < len; i++) row[x1 + i] = blendPixel(row[x1 + i], src[i], &bw[mrow[i]]);
+        accesses += 4ul * len;
+      }
+    }
+  }
+  free(order);
+  free(cover);
+  free(pieces);
+  free(weights);
+  PIXMEM += accesses;  // count pixel memory accesses
+}
+
+
+// Find the position (*ax, *ay) of a pixel with the rarest level of img,
+// a good probe to reject windows that do not match img quickly.
+// Searches of one img should find it once, and pass it to matchProbed.
+static void imageAnchor(Image img, int* ax, int* ay) {
+  *ax = *ay = 0;
+  ImageHist hist;
+  ImageHistogram(img, &hist);
+  int rare = hist.min;
+  for (int v = 0; v < 256; v++) {
+    if (hist.count[v] > 0 && hist.count[v] < hist.count[rare]) rare = v;
+  }
+  for (int y = 0; y < img->height; y++) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    const uint8* p = memchr(row, rare, img->width);
+    if (p != NULL) {
+      *ax = (int)(p - row);
+      *ay = y;
+      return;
+    }
+  }
+}
+
+// Does img2 match the subimage of img1 at (x, y)?  (It must fit.)
+// Probes the first pixel, pixel (ax, ay) of img2 and the last row, and only
+// then compares the other rows.
+static int matchProbed(Image img1, int x, int y, Image img2, int ax, int ay) {
+  int subimgWidth = img2->width;
+  int subimgHeight = img2->height;
+  const uint8* p1 = img1->pixel + (size_t)y * img1->stride + x;
+  const uint8* p2 = img2->pixel;
+  size_t stride1 = (size_t)img1->stride;
+  size_t stride2 = (size_t)img2->stride;
+  PIXMEM += 2;  // count pixel memory accesses
+  if (p1[0] != p2[0]) return 0;
+  PIXMEM += 2;
+  if (p1[ay * stride1 + ax] != p2[ay * stride2 + ax]) return 0;
+  int last = subimgHeight - 1;
+  PIXMEM += 2ul * subimgWidth;
+  if (memcmp(p1 + last * stride1, p2 + last * stride2, subimgWidth) != 0) return 0;
+
+  for (int j = 0; j < last; j++) {
+    PIXMEM += 2ul * subimgWidth;
+    if (memcmp(p1 + j * stride1, p2 + j * stride2, subimgWidth) != 0) return 0;
+  }
+
+  // Se chegou até aqui, as imagens coincidem
+  return 1;
+}
+
+/// Compare an image to a subimage of a larger image.
+/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+/// A few probes are checked first (the first pixel, the center pixel, and
+/// the last row), so most mismatches are rejected without comparing the
+/// whole window.  Then the rows are compared whole.
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(ImageValidPos(img1, x, y));
+
+  int subimgWidth = ImageWidth(img2);
+  int subimgHeight = ImageHeight(img2);
+
+  // Verifica se a subimagem cabe dentro da imagem maior
+  if (!ImageValidRect(img1, x, y, subimgWidth, subimgHeight)) {
+    errCause = "Subimagem não cabe (ImageMatchSubImage)";
+    return 0;
+  }
+
+  return matchProbed(img1, x, y, img2, subimgWidth / 2, subimgHeight / 2);
+}
+
+
+// Does img2 match the subimage of img1 at (x, y)?  (It must fit.)
+static int subImageEqual(Image img1, int x, int y, Image img2) {
+  for (int j = 0; j < img2->height; j++) {
+    if (memcmp(img1->pixel + (size_t)(y + j) * img1->stride + x,
+               img2->pixel + (size_t)j * img2->stride, img2->width) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Polynomial hashes (mod 2^64) for the 2D Rabin-Karp search.
+// The hash of a row segment p[0..w) is sum p[i]*ROWBASE^(w-1-i), and the
+// hash of h consecutive row hashes r[0..h) is sum r[j]*COLBASE^(h-1-j).
+// Both can be rolled one position in constant time.
+// Hashes only select candidates: every match is confirmed exactly.
+#define ROWBASE 0x9e3779b97f4a7c15ull
+#define COLBASE 0xc2b2ae3d27d4eb4full
+
+// Power base^n mod 2^64.
+static uint64_t hashPower(uint64_t base, int n) {
+  uint64_t r = 1;
+  for (; n > 0; n >>= 1, base *= base) {
+    if (n & 1) r *= base;
+  }
+  return r;
+}
+
+// Hashes of all the n-w+1 segments of width w of row p, into hash.
+// top is ROWBASE^w.
+static void rowHashes(const uint8* p, int n, int w, uint64_t top, uint64_t* hash) {
+  uint64_t hv = 0;
+  for (int i = 0; i < w; i++) hv = hv * ROWBASE + p[i];
+  hash[0] = hv;
+  for (int x = 1; x + w <= n; x++) {
+    hv = hv * ROWBASE - p[x - 1] * top + p[x + w - 1];
+    hash[x] = hv;
+  }
+}
+
+// Candidate positions of a rolling-hash search, rows [y0, y1), and the
+// matches found there, in row-major order.
+struct locateBand {
+  int y0, y1;
+  int limit;          // stop after this many matches
+  ImagePos* pos;      // matches (grown with realloc, unless limit <= cap)
+  int n, cap;
+  int failed;         // out of memory, or cancelled?
+  uint64_t pixels;    // pixels hashed
+  uint64_t compared;  // pixels compared to confirm candidates
+};
+
+// Hash of the template img2, using hashes (one row) as scratch.
+static uint64_t templateHash(Image img2, uint64_t* hashes) {
+  uint64_t rowTop = hashPower(ROWBASE, img2->width);
+  uint64_t target = 0;
+  for (int j = 0; j < img2->height; j++) {
+    rowHashes(img2->pixel + (size_t)j * img2->stride, img2->width, img2->width, rowTop, hashes);
+    target = target * COLBASE + hashes[0];
+  }
+  return target;
+}
+
+// Search img2 (with hash target) in img1 at the positions of band, using
+// hashes (3 rows of img1->width - img2->width + 1) as scratch.
+// Stops early if *cancel (when not NULL) becomes nonzero.
+static void locateScan(Image img1, Image img2, uint64_t target, uint64_t* hashes,
+                       struct locateBand* band, const volatile int* cancel) {
+  int w = img2->width;
+  int h = img2->height;
+  int n = img1->width - w + 1;
+  uint64_t* in = hashes;
+  uint64_t* out = in + n;
+  uint64_t* col = out + n;
+  uint64_t rowTop = hashPower(ROWBASE, w);
+  uint64_t colTop = hashPower(COLBASE, h);
+  size_t stride = (size_t)img1->stride;
+
+  memset(col, 0, (size_t)n * sizeof(uint64_t));
+  for (int j = 0; j < h; j++) {
+    rowHashes(img1->pixel + (size_t)(band->y0 + j) * stride, img1->width, w, rowTop, in);
+    for (int x = 0; x < n; x++) col[x] = col[x] * COLBASE + in[x];
+  }
+  band->pixels += (uint64_t)img1->width * h;
+
+  for (int y = band->y0; y < band->y1; ++y) {
+    if (cancel != NULL && *cancel) {
+      band->failed = 1;
+      return;
+    }
+    for (int x = 0; x < n; ++x) {
+      if (col[x] != target) continue;
+      band->compared += (uint64_t)w * h;
+      if (!subImageEqual(img1, x, y, img2)) continue;
+      if (band->n == band->cap) {
+        int cap = (band->cap < 16) ? 16 : 2 * band->cap;
+        ImagePos* pos = realloc(band->pos, (size_t)cap * sizeof(ImagePos));
+        if (pos == NULL) {
+          band->failed = 1;
+          return;
+        }
+        band->pos = pos;
+        band->cap = cap;
+      }
+      band->pos[band->n++] = (ImagePos){x, y};
+      if (band->n == band->limit) return;
+    }
+    if (y + 1 == band->y1) break;
+    // Slide the window down: row y leaves, row y+h enters
+    rowHashes(img1->pixel + y * stride, img1->width, w, rowTop, out);
+    rowHashes(img1->pixel + (y + h) * stride, img1->width, w, rowTop, in);
+    for (int x = 0; x < n; x++) col[x] = col[x] * COLBASE - out[x] * colTop + in[x];
+    band->pixels += 2ul * img1->width;
+  }
+}
+
+/// Locate a subimage inside another image.
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// When several positions match, the first in row-major order (lowest y,
+/// then lowest x) is returned.
+/// This uses a 2D rolling hash: the expected cost is O(W*H), whatever the
+/// size of img2, with working memory for a few rows of hashes.
+int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  //Ver as diferenças de tamanho entre img1 e img2
+  int height_diff = img1->height - img2->height;
+  int width_diff = img1->width - img2->width;
+  if (height_diff < 0 || width_diff < 0 || img2->width == 0 || img2->height == 0) {
+    return 0;
+  }
+
+  ImagePos match;
+  struct locateBand band = { 0, height_diff + 1, 1, &match, 0, 1, 0, 0, 0 };
+  uint64_t* hashes = malloc(3 * ((size_t)width_diff + 1) * sizeof(uint64_t));
+  if (hashes != NULL) {
+    locateScan(img1, img2, templateHash(img2, hashes), hashes, &band, NULL);
+    free(hashes);
+  } else {
+    // Short of memory: compare at every position
+    int ax, ay;
+    imageAnchor(img2, &ax, &ay);
+    for (int y = 0; y <= height_diff && band.n == 0; ++y) {
+      for (int x = 0; x <= width_diff; ++x) {
+        if (matchProbed(img1, x, y, img2, ax, ay)) {
+          match = (ImagePos){x, y};
+          band.n = 1;
+          break;
+        }
+      }
+    }
+  }
+  PIXMEM += band.pixels + band.compared;  // count pixel memory accesses
+  PIXCMP += band.compared;
+
+  if (band.n == 0) return 0;  // No match found
+  *px = match.x;
+  *py = match.y;
+  return 1;
+}
+
+// A search of ImageLocateAll, split in bands of rows.
+struct locateJob {
+  Image img1, img2;
+  uint64_t target;
+  struct locateBand* bands;
+  int nbands;
+  int next;                   // next band
+  const volatile int* cancel;
+  pthread_mutex_t lock;       // protects next
+};
+
+// A worker thread of a locate job, with its own scratch space.
+struct locateWorker {
+  struct locateJob* job;
+  uint64_t* hashes;
+};
+
+// Worker of ImageLocateAll: search bands until none is left.
+static void* locateRun(void* arg) {
+  struct locateWorker* worker = (struct locateWorker*)arg;
+  struct locateJob* job = worker->job;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    int t = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (t >= job->nbands) break;
+    locateScan(job->img1, job->img2, job->target, worker->hashes, &job->bands[t], job->cancel);
+  }
+  return NULL;
+}
+
+// Searches with fewer candidate positions than this use a single thread.
+#define LOCATETHREADED (1 << 20)
+
+/// Locate all the occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and stores the positions of the matches
+/// in row-major order in the array *pos of *cap positions.
+/// *pos must be NULL (with *cap = 0) or point to memory allocated with
+/// malloc; it is grown with realloc as needed, updating *pos and *cap.
+/// (The caller is responsible for freeing *pos!)
+/// At most max matches are stored (the first ones), or all of them if
+/// max <= 0.
+/// The rows of img1 are split across threads, one per available processor.
+/// If cancel is not NULL, the search stops as soon as possible once *cancel
+/// becomes nonzero (for instance, set from another thread).
+/// Returns the number of matches stored, or -1 if the search was
+/// cancelled or memory was short (then errCause is set).
+int ImageLocateAll(Image img1, Image img2, ImagePos** pos, int* cap, int max,
+                   const volatile int* cancel) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (pos != NULL && cap != NULL);
+  assert (*cap >= 0 && (*pos != NULL || *cap == 0));
+  int w = img2->width;
+  int h = img2->height;
+  int rows = img1->height - h + 1;
+  int n = img1->width - w + 1;
+  if (rows <= 0 || n <= 0 || w == 0 || h == 0) return 0;
+  if (max <= 0) max = INT_MAX;
+
+  // Bands of at least 2h rows, so hashing their first rows is not a
+  // large overhead, and a few bands per thread to balance the load
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = (ncpu < 1) ? 1 : (ncpu > 64) ? 64 : (int)ncpu;
+  if ((long)rows * n < LOCATETHREADED) nthreads = 1;
+  int minRows = (2 * h > 32) ? 2 * h : 32;
+  int nbands = (rows + minRows - 1) / minRows;
+  if (nbands > 4 * nthreads) nbands = 4 * nthreads;
+  if (nthreads > nbands) nthreads = nbands;
+  int bandRows = (rows + nbands - 1) / nbands;
+  nbands = (rows + bandRows - 1) / bandRows;
+
+  struct locateJob job = { img1, img2, 0, NULL, nbands, 0, cancel };
+  job.bands = calloc((size_t)nbands, sizeof(struct locateBand));
+  struct locateWorker workers[64];
+  int nbuf = 0;
+  while (job.bands != NULL && nbuf < nthreads &&
+         (workers[nbuf].hashes = malloc(3 * (size_t)n * sizeof(uint64_t))) != NULL) {
+    workers[nbuf++].job = &job;
+  }
+  if (!check( nbuf > 0, "Failed to allocate memory in ImageLocateAll" )) {
+    free(job.bands);
+    return -1;
+  }
+  nthreads = nbuf;
+  for (int t = 0; t < nbands; t++) {
+    job.bands[t].y0 = t * bandRows;
+    job.bands[t].y1 = (rows < (t + 1) * bandRows) ? rows : (t + 1) * bandRows;
+    job.bands[t].limit = max;
+  }
+  job.target = templateHash(img2, workers[0].hashes);
+
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_t tid[64];
+  int started = 0;
+  // The calling thread is one of the workers
+  while (started < nthreads - 1 &&
+         pthread_create(&tid[started], NULL, locateRun, &workers[started + 1]) == 0) {
+    started++;
+  }
+  locateRun(&workers[0]);
+  for (int t = 0; t < started; t++) {
+    pthread_join(tid[t], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  for (int t = 0; t < nbuf; t++) free(workers[t].hashes);
+
+  // Gather the matches of the bands, in order
+  int total = 0;
+  int failed = 0;
+  for (int t = 0; t < nbands; t++) {
+    struct locateBand* band = &job.bands[t];
+    PIXMEM += band->pixels + band->compared;  // count pixel memory accesses
+    PIXCMP += band->compared;
+    failed |= band->failed;
+    if (total + band->n > max) band->n = max - total;
+    total += band->n;
+  }
+  if (!failed && total > *cap) {
+    ImagePos* grown = realloc(*pos, (size_t)total * sizeof(ImagePos));
+    if (grown != NULL) {
+      *pos = grown;
+      *cap = total;
+    }
+    failed = (grown == NULL);
+  }
+  if (!failed) {
+    int k = 0;
+    for (int t = 0; t < nbands; t++) {
+      if (job.bands[t].n > 0) {
+        memcpy(*pos + k, job.bands[t].pos, (size_t)job.bands[t].n * sizeof(ImagePos));
+        k += job.bands[t].n;
+      }
+    }
+  }
+  for (int t = 0; t < nbands; t++) free(job.bands[t].pos);
+  free(job.bands);
+  if (!check( !failed, (cancel != NULL && *cancel) ? "ImageLocateAll cancelled" :
+                       "Failed to allocate memory in ImageLocateAll" )) {
+    return -1;
+  }
+  return total;
+}
+
+// Search of several templates at once (ImageLocateMany).
+// The templates are grouped by width, and each group rolls the column
+// hashes of its windows down the image, as locateScan does, with the
+// least height h of its templates.  The hashes of the top h rows of all
+// the templates go into a single open addressing table, so each position
+// costs one probe per group, however many templates there are.
+// The groups advance together, row by row, so the image is read once.
+
+// A group of templates of the same width w.
+struct manyGroup {
+  int w, h;          // width, least height of the templates
+  int n;             // positions per row
+  int left;          // templates not found yet
+  uint64_t rowTop, colTop;
+  uint64_t* col;     // hashes of the windows at the current row
+};
+
+// A table slot: the templates of group g whose top rows hash to key,
+// chained by next (first is -1 for an empty slot).
+struct manySlot {
+  uint64_t key;
+  int g;
+  int first;
+};
+
+// Slot of (key, g) in a table of 1<<bits slots: the hashes are
+// polynomials, so their high bits are the best mixed.
+static size_t manyIndex(uint64_t key, int g, int bits) {
+  return (size_t)(((key ^ (uint64_t)g * COLBASE) * ROWBASE) >> (64 - bits));
+}
+
+// Order of templates by width, then height.
+static int manyCompare(const void* a, const void* b) {
+  const int* p = (const int*)a;
+  const int* q = (const int*)b;
+  if (p[0] != q[0]) return (p[0] < q[0]) ? -1 : 1;
+  if (p[1] != q[1]) return (p[1] < q[1]) ? -1 : 1;
+  return (p[2] < q[2]) ? -1 : (p[2] > q[2]);
+}
+
+/// Locate several subimages inside an image.
+/// Searches for each of the n images tmpl[0..n) inside img, and sets
+/// results[i] to the first position in row-major order where tmpl[i]
+/// matches (as ImageLocateSubImage would), or to (-1, -1) if it does not.
+/// The templates are hashed into a single table and img is scanned only
+/// once, so the cost is O(W*H) per distinct template width, plus the
+/// hashing of the templates, rather than per template.
+/// Returns the number of templates found, or -1 if memory was short
+/// (then errCause is set).
+int ImageLocateMany(Image img, Image* tmpl, int n, ImagePos* results) { ///
+  assert (img != NULL);
+  assert (n >= 0);
+  assert (n == 0 || (tmpl != NULL && results != NULL));
+  int W = img->width;
+  int H = img->height;
+
+  // Templates that fit (and are not empty) as (width, height, index)
+  int (*order)[3] = malloc(((size_t)n + 1) * sizeof(*order));
+  int* next = malloc(((size_t)n + 1) * sizeof(int));
+  struct manyGroup* groups = calloc((size_t)n + 1, sizeof(struct manyGroup));
+  uint64_t* scratch = malloc(2 * ((size_t)W + 1) * sizeof(uint64_t));
+  struct manySlot* table = NULL;
+  int count = 0;
+  int ngroups = 0;
+  int bits = 1;
+  int ok = order != NULL && next != NULL && groups != NULL && scratch != NULL;
+  for (int i = 0; ok && i < n; i++) {
+    assert (tmpl[i] != NULL);
+    results[i] = (ImagePos){-1, -1};
+    int w = tmpl[i]->width;
+    int h = tmpl[i]->height;
+    if (w == 0 || h == 0 || w > W || h > H) continue;
+    order[count][0] = w;
+    order[count][1] = h;
+    order[count][2] = i;
+    count++;
+  }
+  if (ok && count > 0) {
+    qsort(order, (size_t)count, sizeof(*order), manyCompare);
+    for (int t = 0; t < count; t++) {
+      if (ngroups == 0 || groups[ngroups - 1].w != order[t][0]) {
+        struct manyGroup* grp = &groups[ngroups++];
+        grp->w = order[t][0];
+        grp->h = order[t][1];  // sorted: the least height comes first
+        grp->n = W - grp->w + 1;
+        grp->rowTop = hashPower(ROWBASE, grp->w);
+        grp->colTop = hashPower(COLBASE, grp->h);
+        grp->col = malloc((size_t)grp->n * sizeof(uint64_t));
+        ok &= grp->col != NULL;
+      }
+      groups[ngroups - 1].left++;
+    }
+    while ((1 << bits) < 2 * count) bits++;
+    table = malloc(((size_t)1 << bits) * sizeof(struct manySlot));
+    ok &= table != NULL;
+  }
+  if (!check( ok, "Failed to allocate memory in ImageLocateMany" )) {
+    for (int g = 0; groups != NULL && g < ngroups; g++) free(groups[g].col);
+    free(order);
+    free(next);
+    free(groups);
+    free(scratch);
+    free(table);
+    return -1;
+  }
+
+  // Hash the top rows of the templates into the table
+  uint64_t pixels = 0;
+  uint64_t compared = 0;
+  size_t mask = ((size_t)1 << bits) - 1;
+  for (size_t s = 0; s <= mask && table != NULL; s++) table[s].first = -1;
+  for (int t = 0, g = -1; t < count; t++) {
+    if (g < 0 || groups[g].w != order[t][0]) g++;
+    Image img2 = tmpl[order[t][2]];
+    uint64_t key = 0;
+    for (int j = 0; j < groups[g].h; j++) {
+      rowHashes(img2->pixel + (size_t)j * img2->stride, img2->width, img2->width,
+                groups[g].rowTop, scratch);
+      key = key * COLBASE + scratch[0];
+    }
+    pixels += (uint64_t)groups[g].w * groups[g].h;
+    size_t s = manyIndex(key, g, bits);
+    while (table[s].first >= 0 && (table[s].key != key || table[s].g != g)) {
+      s = (s + 1) & mask;
+    }
+    if (table[s].first < 0) {
+      table[s] = (struct manySlot){ key, g, -1 };
+    }
+    next[order[t][2]] = table[s].first;
+    table[s].first = order[t][2];
+  }
+
+  // One pass down the image: every group slides its windows one row
+  int left = count;
+  int top = H;  // least height of all the templates
+  for (int g = 0; g < ngroups; g++) top = (groups[g].h < top) ? groups[g].h : top;
+  uint64_t* in = scratch;
+  uint64_t* out = scratch + W + 1;
+  size_t stride = (size_t)img->stride;
+  for (int y = 0; left > 0 && y + top <= H; y++) {
+    for (int g = 0; g < ngroups && left > 0; g++) {
+      struct manyGroup* grp = &groups[g];
+      if (grp->left == 0 || y + grp->h > H) continue;
+      int w = grp->w;
+      int h = grp->h;
+      uint64_t* col = grp->col;
+      if (y == 0) {
+        memset(col, 0, (size_t)grp->n * sizeof(uint64_t));
+        for (int j = 0; j < h; j++) {
+          rowHashes(img->pixel + j * stride, W, w, grp->rowTop, in);
+          for (int x = 0; x < grp->n; x++) col[x] = col[x] * COLBASE + in[x];
+        }
+        pixels += (uint64_t)W * h;
+      } else {
+        // Row y-1 leaves, row y+h-1 enters
+        rowHashes(img->pixel + (y - 1) * stride, W, w, grp->rowTop, out);
+        rowHashes(img->pixel + (y + h - 1) * stride, W, w, grp->rowTop, in);
+        for (int x = 0; x < grp->n; x++) {
+          col[x] = col[x] * COLBASE - out[x] * grp->colTop + in[x];
+        }
+        pixels += 2ul * W;
+      }
+      for (int x = 0; x < grp->n; x++) {
+        size_t s = manyIndex(col[x], g, bits);
+        while (table[s].first >= 0 && (table[s].key != col[x] || table[s].g != g)) {
+          s = (s + 1) & mask;
+        }
+        for (int i = table[s].first; i >= 0; i = next[i]) {
+          Image img2 = tmpl[i];
+          if (results[i].x >= 0 || y + img2->height > H) continue;
+          compared += (uint64_t)w * img2->height;
+          if (!subImageEqual(img, x, y, img2)) continue;
+          results[i] = (ImagePos){x, y};
+          grp->left--;
+          left--;
+        }
+      }
+    }
+  }
+  PIXMEM += pixels + compared;  // count pixel memory accesses
+  PIXCMP += compared;
+
+  for (int g = 0; g < ngroups; g++) free(groups[g].col);
+  free(order);
+  free(next);
+  free(groups);
+  free(scratch);
+  free(table);
+  return count - left;
+}
+
+
+// Approximate template matching.
+// Each position (x, y) where tmpl fits in img gets a score comparing tmpl
+// with the window of img at (x, y), with N = w*h pixels:
+//   SAD = sum |I-T|,  SSD = sum (I-T)^2 = S2 - 2*C + T2,
+//   NCC = (N*C - S1*T1) / sqrt((N*S2 - S1^2) * (N*T2 - T1^2)),
+// where S1, S2 are the sums of the window levels and of their squares
+// (running box sums), T1, T2 the same for tmpl, and C is the
+// cross-correlation sum I*T.
+// SAD is computed directly, with psadbw.  C is computed directly for
+// small templates, and otherwise with FFTs by overlap-save: the image is
+// cut in tiles of fx by fy pixels, each giving (fx-w+1)*(fy-h+1) scores,
+// and two tiles go through each complex FFT, one as the real part and the
+// other as the imaginary part.  C is an integer, so rounding the FFT
+// result makes it exact.
+// Scores are produced in bands of rows, in order, so that the callers can
+// keep a map, the best positions, or stop at the first good one.
+
+#define MATCHDIRECT 400     // smaller templates (in pixels) are correlated directly
+#define MATCHFFTMAX 2048    // largest FFT size
+#define MATCHBAND 16        // rows of a band, when not using FFTs
+
+struct matchWork {
+  Image img, tmpl;
+  ImageMetric metric;
+  int nx, ny;         // positions in x and y
+  int bandRows;       // rows of positions in a band
+  double t1, t2;      // sums of the template levels and of their squares
+  uint64_t* col1;     // sums of the levels of each image column...
+  uint64_t* col2;     // ...and of their squares, in rows [colRow, colRow+h)
+  int colRow;
+  double* cc;         // cross-correlations (or SADs) of a band
+  int32_t* acc;       // direct cross-correlation of a row
+  int fx, fy;         // FFT tile size (0 for direct correlation)
+  double* tre;        // conjugate of the FFT of the template...
+  double* tim;
+  double* re;         // ...and of a pair of tiles
+  double* im;
+  double* cre;        // a column of the tiles
+  double* cim;
+  double* twc;        // twiddle factors cos and sin(2*pi*k/max(fx, fy))
+  double* tws;
+};
+
+static void matchFree(struct matchWork* mw) {
+  free(mw->col1);
+  free(mw->col2);
+  free(mw->cc);
+  free(mw->acc);
+  free(mw->tre);
+  free(mw->tim);
+  free(mw->re);
+  free(mw->im);
+  free(mw->cre);
+  free(mw->cim);
+  free(mw->twc);
+  free(mw->tws);
+}
+
+// In-place radix-2 FFT of the n complex values re[k] + i*im[k] (n a power
+// of 2, not above nmax), forward (e^-i) or inverse (e^+i, not scaled).
+// twc and tws hold cos and sin of 2*pi*k/nmax, for k < nmax/2.
+static void fft(double* re, double* im, int n, const double* twc, const double* tws,
+                int nmax, int inverse) {
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      double t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  for (int len = 2; len <= n; len <<= 1) {
+    int half = len >> 1;
+    int step = nmax / len;
+    for (int i = 0; i < n; i += len) {
+      double* ar = re + i;
+      double* ai = im + i;
+      double* br = ar + half;
+      double* bi = ai + half;
+      for (int k = 0; k < half; k++) {
+        double c = twc[k * step];
+        double s = inverse ? tws[k * step] : -tws[k * step];
+        double vr = br[k] * c - bi[k] * s;
+        double vi = br[k] * s + bi[k] * c;
+        br[k] = ar[k] - vr;
+        bi[k] = ai[k] - vi;
+        ar[k] += vr;
+        ai[k] += vi;
+      }
+    }
+  }
+}
+
+// 2D FFT of a tile of fx by fy complex values, rows then columns.
+static void fft2d(struct matchWork* mw, double* re, double* im, int inverse) {
+  int fx = mw->fx;
+  int fy = mw->fy;
+  int nmax = (fx > fy) ? fx : fy;
+  for (int y = 0; y < fy; y++) {
+    fft(re + (size_t)y * fx, im + (size_t)y * fx, fx, mw->twc, mw->tws, nmax, inverse);
+  }
+  for (int x = 0; x < fx; x++) {
+    for (int y = 0; y < fy; y++) {
+      mw->cre[y] = re[(size_t)y * fx + x];
+      mw->cim[y] = im[(size_t)y * fx + x];
+    }
+    fft(mw->cre, mw->cim, fy, mw->twc, mw->tws, nmax, inverse);
+    for (int y = 0; y < fy; y++) {
+      re[(size_t)y * fx + x] = mw->cre[y];
+      im[(size_t)y * fx + x] = mw->cim[y];
+    }
+  }
+}
+
+// Copy the fx by fy tile of img at (x0, y0) into t, with zeros outside img.
+static void fftTile(double* t, Image img, int x0, int y0, int fx, int fy) {
+  memset(t, 0, (size_t)fx * fy * sizeof(double));
+  int w = (img->width - x0 < fx) ? img->width - x0 : fx;
+  int h = (img->height - y0 < fy) ? img->height - y0 : fy;
+  for (int y = 0; y < h; y++) {
+    const uint8* p = img->pixel + (size_t)(y0 + y) * img->stride + x0;
+    for (int x = 0; x < w; x++) t[(size_t)y * fx + x] = p[x];
+  }
+}
+
+// Best FFT size for n positions of a template of size w: the power of 2
+// minimizing the cost of the tiles, about tiles * size * log(size).
+// Returns 0 if no size is acceptable.
+static int fftSize(int n, int w) {
+  int best = 0;
+  double bestCost = 0.0;
+  for (int size = 2, lg = 1; size <= MATCHFFTMAX; size *= 2, lg++) {
+    if (size < w) continue;
+    int tiles = (n + size - w) / (size - w + 1);
+    double cost = (double)tiles * size * lg;
+    if (best == 0 || cost < bestCost) {
+      best = size;
+      bestCost = cost;
+    }
+    if (size - w + 1 >= n) break;   // a single tile covers all
+  }
+  return best;
+}
+
+// Sum of |a[i] - b[i]| for i < n.
+static uint32_t sadRow(const uint8* a, const uint8* b, int n) {
+  uint32_t s = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  s = (uint32_t)_mm_cvtsi128_si32(acc) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  for (; i < n; i++) s += (uint32_t)abs(a[i] - b[i]);
+  return s;
+}
+
+// acc[x] += t * p[x], for x < n.
+static void correlateTap(int32_t* acc, const uint8* p, int t, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  // The products fit 16 bits unsigned
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i vt = _mm_set1_epi16((short)t);
+  for (; x + 16 <= n; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + x));
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), vt);
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), vt);
+    __m128i* a = (__m128i*)(acc + x);
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, zero)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+    _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+    _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+  }
+#endif
+  for (; x < n; x++) acc[x] += t * p[x];
+}
+
+// Prepare mw to match tmpl in img with metric.
+// Returns 0 (with errCause set) if memory is short.
+static int matchInit(struct matchWork* mw, Image img, Image tmpl, ImageMetric metric) {
+  memset(mw, 0, sizeof(*mw));
+  mw->img = img;
+  mw->tmpl = tmpl;
+  mw->metric = metric;
+  int w = tmpl->width;
+  int h = tmpl->height;
+  mw->nx = img->width - w + 1;
+  mw->ny = img->height - h + 1;
+  mw->colRow = -1;
+  for (int y = 0; y < h; y++) {
+    const uint8* p = tmpl->pixel + (size_t)y * tmpl->stride;
+    for (int x = 0; x < w; x++) {
+      mw->t1 += p[x];
+      mw->t2 += (double)p[x] * p[x];
+    }
+  }
+  if (metric != IMAGE_SAD && (long)w * h > MATCHDIRECT) {
+    mw->fx = fftSize(mw->nx, w);
+    mw->fy = fftSize(mw->ny, h);
+    if (mw->fx == 0 || mw->fy == 0) mw->fx = mw->fy = 0;
+  }
+  mw->bandRows = (mw->fx > 0) ? mw->fy - h + 1 : MATCHBAND;
+  if (mw->bandRows > mw->ny) mw->bandRows = mw->ny;
+
+  size_t width = (size_t)img->width;
+  mw->col1 = malloc(width * sizeof(uint64_t));
+  mw->col2 = malloc(width * sizeof(uint64_t));
+  mw->cc = malloc((size_t)mw->bandRows * mw->nx * sizeof(double));
+  int ok = mw->col1 != NULL && mw->col2 != NULL && mw->cc != NULL;
+  if (mw->fx > 0) {
+    size_t tile = (size_t)mw->fx * mw->fy;
+    int nmax = (mw->fx > mw->fy) ? mw->fx : mw->fy;
+    mw->tre = malloc(tile * sizeof(double));
+    mw->tim = malloc(tile * sizeof(double));
+    mw->re = malloc(tile * sizeof(double));
+    mw->im = malloc(tile * sizeof(double));
+    mw->cre = malloc((size_t)mw->fy * sizeof(double));
+    mw->cim = malloc((size_t)mw->fy * sizeof(double));
+    mw->twc = malloc((size_t)nmax / 2 * sizeof(double));
+    mw->tws = malloc((size_t)nmax / 2 * sizeof(double));
+    ok = ok && mw->tre != NULL && mw->tim != NULL && mw->re != NULL && mw->im != NULL &&
+         mw->cre != NULL && mw->cim != NULL && mw->twc != NULL && mw->tws != NULL;
+    if (ok) {
+      for (int k = 0; k < nmax / 2; k++) {
+        mw->twc[k] = cos(2.0 * M_PI * k / nmax);
+        mw->tws[k] = sin(2.0 * M_PI * k / nmax);
+      }
+      fftTile(mw->tre, tmpl, 0, 0, mw->fx, mw->fy);
+      memset(mw->tim, 0, tile * sizeof(double));
+      fft2d(mw, mw->tre, mw->tim, 0);
+      for (size_t i = 0; i < tile; i++) mw->tim[i] = -mw->tim[i];
+    }
+  } else if (metric != IMAGE_SAD) {
+    mw->acc = malloc((size_t)mw->nx * sizeof(int32_t));
+    ok = ok && mw->acc != NULL;
+  }
+  if (!check( ok, "Failed to allocate memory in template matching" )) {
+    matchFree(mw);
+    return 0;
+  }
+  return 1;
+}
+
+// Cross-correlations (or SADs) of the rows of positions [y0, y0+rows)
+// into mw->cc.
+static void matchCorrelate(struct matchWork* mw, int y0, int rows) {
+  Image img = mw->img;
+  Image tmpl = mw->tmpl;
+  int w = tmpl->width;
+  int h = tmpl->height;
+  int nx = mw->nx;
+  size_t stride = (size_t)img->stride;
+
+  if (mw->metric == IMAGE_SAD) {
+    for (int r = 0; r < rows; r++) {
+      for (int x = 0; x < nx; x++) {
+        uint32_t s = 0;
+        for (int j = 0; j < h; j++) {
+          s += sadRow(img->pixel + (y0 + r + j) * stride + x,
+                      tmpl->pixel + (size_t)j * tmpl->stride, w);
+        }
+        mw->cc[(size_t)r * nx + x] = s;
+      }
+    }
+  } else if (mw->fx == 0) {
+    // Each template row is summed in 32 bits, and the rows in double
+    // (templates too large for the FFTs also come here)
+    for (int r = 0; r < rows; r++) {
+      double* cc = mw->cc + (size_t)r * nx;
+      memset(cc, 0, (size_t)nx * sizeof(double));
+      for (int j = 0; j < h; j++) {
+        const uint8* p = img->pixel + (y0 + r + j) * stride;
+        const uint8* t = tmpl->pixel + (size_t)j * tmpl->stride;
+        memset(mw->acc, 0, (size_t)nx * sizeof(int32_t));
+        for (int i = 0; i < w; i++) {
+          if (t[i] != 0) correlateTap(mw->acc, p + i, t[i], nx);
+        }
+        for (int x = 0; x < nx; x++) cc[x] += mw->acc[x];
+      }
+    }
+  } else {
+    int fx = mw->fx;
+    int fy = mw->fy;
+    size_t tile = (size_t)fx * fy;
+    int step = fx - w + 1;
+    double scale = 1.0 / ((double)fx * fy);
+    for (int x0 = 0; x0 < nx; x0 += 2 * step) {
+      fftTile(mw->re, img, x0, y0, fx, fy);
+      if (x0 + step < nx) {
+        fftTile(mw->im, img, x0 + step, y0, fx, fy);
+      } else {
+        memset(mw->im, 0, tile * sizeof(double));
+      }
+      fft2d(mw, mw->re, mw->im, 0);
+      for (size_t i = 0; i < tile; i++) {
+        double a = mw->re[i], b = mw->im[i];
+        mw->re[i] = a * mw->tre[i] - b * mw->tim[i];
+        mw->im[i] = a * mw->tim[i] + b * mw->tre[i];
+      }
+      fft2d(mw, mw->re, mw->im, 1);
+      for (int r = 0; r < rows; r++) {
+        double* cc = mw->cc + (size_t)r * nx;
+        for (int dx = 0; dx < step && x0 + dx < nx; dx++) {
+          cc[x0 + dx] = round(mw->re[(size_t)r * fx + dx] * scale);
+        }
+        for (int dx = 0; dx < step && x0 + step + dx < nx; dx++) {
+          cc[x0 + step + dx] = round(mw->im[(size_t)r * fx + dx] * scale);
+        }
+      }
+    }
+  }
+}
+
+// Move the column sums to the h rows starting at row y.
+static void matchColumns(struct matchWork* mw, int y) {
+  Image img = mw->img;
+  int width = img->width;
+  int h = mw->tmpl->height;
+  size_t stride = (size_t)img->stride;
+  if (y == mw->colRow + 1 && mw->colRow >= 0) {
+    const uint8* out = img->pixel + (y - 1) * stride;
+    const uint8* in = img->pixel + (y + h - 1) * stride;
+    for (int x = 0; x < width; x++) {
+      mw->col1[x] += (uint64_t)in[x] - out[x];
+      mw->col2[x] += (uint64_t)in[x] * in[x] - (uint64_t)out[x] * out[x];
+    }
+  } else {
+    memset(mw->col1, 0, (size_t)width * sizeof(uint64_t));
+    memset(mw->col2, 0, (size_t)width * sizeof(uint64_t));
+    for (int j = 0; j < h; j++) {
+      const uint8* p = img->pixel + (y + j) * stride;
+      for (int x = 0; x < width; x++) {
+        mw->col1[x] += p[x];
+        mw->col2[x] += (uint64_t)p[x] * p[x];
+      }
+    }
+  }
+  mw->colRow = y;
+}
+
+// Scores of the rows of positions [y0, y0+rows), into mw->cc.
+static void matchBand(struct matchWork* mw, int y0, int rows) {
+  matchCorrelate(mw, y0, rows);
+  if (mw->metric == IMAGE_SAD) return;
+  int w = mw->tmpl->width;
+  int nx = mw->nx;
+  double n = (double)w * mw->tmpl->height;
+  double tvar = n * mw->t2 - mw->t1 * mw->t1;
+  for (int r = 0; r < rows; r++) {
+    matchColumns(mw, y0 + r);
+    double* cc = mw->cc + (size_t)r * nx;
+    uint64_t s1 = 0, s2 = 0;
+    for (int i = 0; i < w - 1; i++) {
+      s1 += mw->col1[i];
+      s2 += mw->col2[i];
+    }
+    for (int x = 0; x < nx; x++) {
+      // Window sums of columns [x, x+w)
+      s1 += mw->col1[x + w - 1];
+      s2 += mw->col2[x + w - 1];
+      if (mw->metric == IMAGE_SSD) {
+        cc[x] = (double)s2 - 2.0 * cc[x] + mw->t2;
+      } else {
+        double var = n * (double)s2 - (double)s1 * (double)s1;
+        double den = var * tvar;
+        cc[x] = (den > 0.0) ? (n * cc[x] - (double)s1 * mw->t1) / sqrt(den) : 0.0;
+      }
+      s1 -= mw->col1[x];
+      s2 -= mw->col2[x];
+    }
+  }
+}
+
+/// Template matching scores.
+/// Compare tmpl with the window of img at each position (x, y) where tmpl
+/// fits, with one of these metrics:
+///   IMAGE_SAD: sum of absolute differences (0 for a perfect match);
+///   IMAGE_SSD: sum of squared differences (0 for a perfect match);
+///   IMAGE_NCC: normalized cross-correlation, in [-1, 1] (1 for a perfect
+///     match up to brightness and contrast, 0 if the window or tmpl is flat).
+/// SAD is computed directly with SIMD; SSD and NCC use running box sums,
+/// and FFTs for templates larger than a few hundred pixels.
+/// Requires: tmpl is not empty and fits in img.
+///
+/// On success, returns a new map of (W-w+1)*(H-h+1) scores, row by row:
+/// the score of position (x, y) is at index y*(W-w+1) + x.
+/// SAD and SSD scores are exact (doubles hold integers up to 2^53).
+/// (The caller is responsible for freeing the returned map!)
+/// On failure, returns NULL and errCause is set.
+double* ImageMatchScore(Image img, Image tmpl, ImageMetric metric) { ///
+  assert (img != NULL && tmpl != NULL);
+  assert (tmpl->width > 0 && tmpl->height > 0);
+  assert (tmpl->width <= img->width && tmpl->height <= img->height);
+  struct matchWork mw;
+  if (!matchInit(&mw, img, tmpl, metric)) return NULL;
+  double* map = malloc((size_t)mw.nx * mw.ny * sizeof(double));
+  if (!check( map != NULL, "Failed to allocate memory in ImageMatchScore" )) {
+    matchFree(&mw);
+    return NULL;
+  }
+  for (int y0 = 0; y0 < mw.ny; y0 += mw.bandRows) {
+    int rows = (mw.ny - y0 < mw.bandRows) ? mw.ny - y0 : mw.bandRows;
+    matchBand(&mw, y0, rows);
+    memcpy(map + (size_t)y0 * mw.nx, mw.cc, (size_t)rows * mw.nx * sizeof(double));
+  }
+  matchFree(&mw);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  return map;
+}
+
+// Cost of a score: lower is better.
+static inline double matchCost(ImageMetric metric, double score) {
+  return (metric == IMAGE_NCC) ? -score : score;
+}
+
+// Is match a worse than match b?  (Ties go to the first in row-major order.)
+static inline int matchWorse(const double* cost, const ImagePos* pos, int a, int b) {
+  if (cost[a] != cost[b]) return cost[a] > cost[b];
+  return (pos[a].y != pos[b].y) ? pos[a].y > pos[b].y : pos[a].x > pos[b].x;
+}
+
+// Swap matches a and b.
+static inline void matchSwap(double* cost, ImagePos* pos, int a, int b) {
+  double c = cost[a]; cost[a] = cost[b]; cost[b] = c;
+  ImagePos p = pos[a]; pos[a] = pos[b]; pos[b] = p;
+}
+
+// Restore the heap (worst match at the root) below node i of n.
+static void matchSift(double* cost, ImagePos* pos, int n, int i) {
+  for (;;) {
+    int worst = i;
+    int l = 2 * i + 1, r = l + 1;
+    if (l < n && matchWorse(cost, pos, l, worst)) worst = l;
+    if (r < n && matchWorse(cost, pos, r, worst)) worst = r;
+    if (worst == i) return;
+    matchSwap(cost, pos, i, worst);
+    i = worst;
+  }
+}
+
+/// Best template matches.
+/// Find the k positions of img where tmpl matches best with metric (see
+/// ImageMatchScore), and store them, best first, in pos[0..k), with their
+/// scores in score[0..k) (if score is not NULL).
+/// Ties are resolved in favor of the first position in row-major order.
+/// Only a band of scores is kept in memory at a time.
+/// Requires: tmpl is not empty and fits in img; k >= 0.
+/// Returns the number of matches stored (k, or fewer if there are fewer
+/// positions), or -1 if memory is short (then errCause is set).
+int ImageMatchBest(Image img, Image tmpl, ImageMetric metric, int k,
+                   ImagePos* pos, double* score) { ///
+  assert (img != NULL && tmpl != NULL);
+  assert (tmpl->width > 0 && tmpl->height > 0);
+  assert (tmpl->width <= img->width && tmpl->height <= img->height);
+  assert (k >= 0 && (k == 0 || pos != NULL));
+  if (k == 0) return 0;
+  struct matchWork mw;
+  double* cost = malloc((size_t)k * sizeof(double));
+  if (!check( cost != NULL, "Failed to allocate memory in ImageMatchBest" ) ||
+      !matchInit(&mw, img, tmpl, metric)) {
+    free(cost);
+    return -1;
+  }
+  int n = 0;
+  for (int y0 = 0; y0 < mw.ny; y0 += mw.bandRows) {
+    int rows = (mw.ny - y0 < mw.bandRows) ? mw.ny - y0 : mw.bandRows;
+    matchBand(&mw, y0, rows);
+    for (int r = 0; r < rows; r++) {
+      for (int x = 0; x < mw.nx; x++) {
+        double c = matchCost(metric, mw.cc[(size_t)r * mw.nx + x]);
+        if (n < k) {
+          // Add it, and sift it up the heap
+          cost[n] = c;
+          pos[n] = (ImagePos){x, y0 + r};
+          for (int i = n++; i > 0 && matchWorse(cost, pos, i, (i - 1) / 2); i = (i - 1) / 2) {
+            matchSwap(cost, pos, i, (i - 1) / 2);
+          }
+        } else if (c < cost[0]) {
+          // (Later positions lose ties)
+          cost[0] = c;
+          pos[0] = (ImagePos){x, y0 + r};
+          matchSift(cost, pos, n, 0);
+        }
+      }
+    }
+  }
+  // Sort, best first: move the worst to the end, repeatedly
+  for (int m = n - 1; m > 0; m--) {
+    matchSwap(cost, pos, 0, m);
+    matchSift(cost, pos, m, 0);
+  }
+  if (score != NULL) {
+    for (int i = 0; i < n; i++) score[i] = matchCost(metric, cost[i]);
+  }
+  free(cost);
+  matchFree(&mw);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  return n;
+}
+
+/// Locate a template in an image with tolerance.
+/// Searches for the first position of img, in row-major order, where the
+/// score of tmpl with metric (see ImageMatchScore) is within threshold:
+/// at most threshold for IMAGE_SAD and IMAGE_SSD, at least threshold for
+/// IMAGE_NCC.
+/// Requires: tmpl is not empty and fits in img.
+/// If a match is found, returns 1 and its position is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Returns -1 if memory is short (then errCause is set).
+int ImageLocateApprox(Image img, int* px, int* py, Image tmpl,
+                      ImageMetric metric, double threshold) { ///
+  assert (img != NULL && tmpl != NULL);
+  assert (px != NULL && py != NULL);
+  assert (tmpl->width > 0 && tmpl->height > 0);
+  assert (tmpl->width <= img->width && tmpl->height <= img->height);
+  struct matchWork mw;
+  if (!matchInit(&mw, img, tmpl, metric)) return -1;
+  double limit = matchCost(metric, threshold);
+  int found = 0;
+  for (int y0 = 0; y0 < mw.ny && !found; y0 += mw.bandRows) {
+    int rows = (mw.ny - y0 < mw.bandRows) ? mw.ny - y0 : mw.bandRows;
+    matchBand(&mw, y0, rows);
+    for (size_t i = 0; i < (size_t)rows * mw.nx; i++) {
+      if (matchCost(metric, mw.cc[i]) <= limit) {
+        *px = (int)(i % mw.nx);
+        *py = y0 + (int)(i / mw.nx);
+        found = 1;
+        break;
+      }
+    }
+  }
+  matchFree(&mw);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  return found;
+}
+
+
+/// Filtering
+
+// Mean of a blur window, rounded as (int)((float)sum / count + 0.5).
+static inline uint8 blurMean(long sum, int count) {
+  return (uint8)(int)((float)sum / count + 0.5);
+}
+
+// A streaming mean filter.
+// It keeps a ring of the last 2dy+1 input rows and the sums of each column
+// over the rows of the current window, so that each output row costs a
+// single horizontal sweep over those column sums.
+struct blurFilter {
+  int width;
+  int height;
+  int dx, dy;
+  int in;         // number of input rows received
+  int out;        // number of output rows produced
+  int lo;         // first input row included in colsum
+  int nring;      // number of rows in the ring
+  uint8* ring;    // row r is stored at ring[(r % nring)*width]
+  long* colsum;   // colsum[x] = sum of column x over rows [lo, in-1]
+};
+
+/// Create a filter that blurs a (width x height) image streamed in bands,
+/// with the same (2dx+1)x(2dy+1) mean filter as ImageBlur.
+/// Requires: width and height must be non-negative, dx, dy >= 0.
+/// On success, a new filter is returned.
+/// (The caller is responsible for destroying the returned filter!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageBlurFilter ImageBlurFilterCreate(int width, int height, int dx, int dy) { ///
+  assert (width >= 0 && height >= 0);
+  assert (dx >= 0 && dy >= 0);
+  ImageBlurFilter bf = (ImageBlurFilter)malloc(sizeof(struct blurFilter));
+  if (!check( bf != NULL, "Failed to allocate memory in ImageBlurFilterCreate" )) {
+    return NULL;
+  }
+  bf->width = width;
+  bf->height = height;
+  bf->dx = dx;
+  bf->dy = dy;
+  bf->in = bf->out = bf->lo = 0;
+  bf->nring = (dy <= (height - 1)/2) ? 2*dy + 1 : height;
+  bf->ring = (uint8*)malloc((size_t)bf->nring * width + 1);
+  bf->colsum = (long*)calloc((size_t)width + 1, sizeof(long));
+  if (!check( bf->ring != NULL && bf->colsum != NULL,
+              "Failed to allocate memory in ImageBlurFilterCreate" )) {
+    ImageBlurFilterDestroy(&bf);
+  }
+  return bf;
+}
+
+// Produce the next output row of bf into dst, using input rows up to in-1.
+static void blurFilterEmit(ImageBlurFilter bf, uint8* dst) {
+  int width = bf->width;
+  int dx = bf->dx;
+  int y = bf->out++;
+  // Drop rows above the window from the column sums
+  while (bf->lo < y - bf->dy) {
+    const uint8* row = bf->ring + (size_t)(bf->lo % bf->nring) * width;
+    for (int x = 0; x < width; x++) bf->colsum[x] -= row[x];
+    bf->lo++;
+  }
+  int cy = bf->in - bf->lo;       // rows in the (clipped) window
+  const long* colsum = bf->colsum;
+  long sum = 0;
+  for (int x = 0; x < dx && x < width; x++) sum += colsum[x];
+  for (int x = 0; x < width; x++) {
+    if (x + dx < width) sum += colsum[x + dx];
+    if (x - dx - 1 >= 0) sum -= colsum[x - dx - 1];
+    int x1 = (x - dx < 0) ? 0 : x - dx;
+    int x2 = (x + dx >= width) ? width - 1 : x + dx;
+    dst[x] = blurMean(sum, (x2 - x1 + 1) * cy);
+  }
+}
+
+// Add the next input row src to the ring and the column sums of bf.
+static void blurFilterAdd(ImageBlurFilter bf, const uint8* src) {
+  int width = bf->width;
+  // Row (in - nring) leaves the ring: it must be out of the window first
+  while (bf->lo <= bf->in - bf->nring) {
+    const uint8* old = bf->ring + (size_t)(bf->lo % bf->nring) * width;
+    for (int x = 0; x < width; x++) bf->colsum[x] -= old[x];
+    bf->lo++;
+  }
+  uint8* slot = bf->ring + (size_t)(bf->in % bf->nring) * width;
+  for (int x = 0; x < width; x++) {
+    slot[x] = src[x];
+    bf->colsum[x] += src[x];
+  }
+  bf->in++;
+}
+
+/// Feed the next rows of the input image to the filter.
+/// The top rows rows of band are consumed, and the output rows that became
+/// complete are written to the top rows of out.
+/// Output lags input by dy rows, and the remaining rows are produced when
+/// the last input row is received.
+/// Requires: band and out have the filter width, 0 <= rows <= band height,
+/// no more rows than the remaining ones, and out has at least rows+dy rows.
+/// Returns the number of rows written to out.
+/// On failure (out is shared and cannot be copied), returns -1 and
+/// errCause is set.
+int ImageBlurFilterPush(ImageBlurFilter bf, Image band, int rows, Image out) { ///
+  assert (bf != NULL);
+  assert (band != NULL && out != NULL);
+  assert (band->width == bf->width && out->width == bf->width);
+  assert (0 <= rows && rows <= band->height);
+  assert (rows <= bf->height - bf->in);
+  assert (out->height >= rows + bf->dy || out->height >= bf->height);
+  int width = bf->width;
+  int produced = 0;
+  if (!prepareWrite(out)) return -1;
+
+  for (int i = 0; i < rows; i++) {
+    blurFilterAdd(bf, band->pixel + (size_t)i * band->stride);
+    if (bf->in - 1 - bf->dy >= bf->out) {
+      blurFilterEmit(bf, out->pixel + (size_t)produced * out->stride);
+      produced++;
+    }
+  }
+  PIXMEM += (unsigned long)rows * width;  // count pixel memory accesses
+  if (bf->in == bf->height) {
+    while (bf->out < bf->height) {
+      blurFilterEmit(bf, out->pixel + (size_t)produced * out->stride);
+      produced++;
+    }
+  }
+  PIXMEM += (unsigned long)produced * width;
+  return produced;
+}
+
+/// Destroy the filter pointed to by (*bfp).
+/// If (*bfp)==NULL, no operation is performed.
+/// Ensures: (*bfp)==NULL.
+void ImageBlurFilterDestroy(ImageBlurFilter* bfp) { ///
+  assert (bfp != NULL);
+  if (*bfp != NULL) {
+    free((*bfp)->ring);
+    free((*bfp)->colsum);
+    free(*bfp);
+    *bfp = NULL;
+  }
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// The cost per pixel does not depend on dx and dy.
+/// If the working memory (about 2dy+1 rows) cannot be allocated,
+/// the image is left unchanged and errCause is set.
+void ImageBlur(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  int height = img->height;
+
+  // The image is streamed through a blur filter, in place: output row y
+  // is only written after input row y+dy was saved in the filter ring.
+  ImageBlurFilter bf = ImageBlurFilterCreate(img->width, height, dx, dy);
+  if (bf == NULL) return;
+  if (!prepareWrite(img)) {
+    ImageBlurFilterDestroy(&bf);
+    return;
+  }
+  size_t stride = (size_t)img->stride;
+  for (int y = 0; y < height; y++) {
+    blurFilterAdd(bf, img->pixel + y * stride);
+    if (y - dy >= bf->out) blurFilterEmit(bf, img->pixel + bf->out * stride);
+  }
+  while (bf->out < height) blurFilterEmit(bf, img->pixel + bf->out * stride);
+  ImageBlurFilterDestroy(&bf);
+  PIXMEM += 2ul * img->width * height;  // count pixel memory accesses
+}
+
+
+// Convolution in fixed point.
+// Kernel weights are scaled by 2^shift and rounded to int16, and pixel
+// rows are widened to int16, so that SSE2 pmaddwd multiplies and adds
+// two taps at a time into int32 accumulators.  The shift is chosen so
+// that no accumulator can overflow.
+// Rows are processed in blocks of CONVBLOCK pixels to keep the
+// accumulators in cache while all the taps are added.
+
+#define CONVBLOCK 2048
+
+// acc[x] += ca*a[x] + cb*b[x], for 0 <= x < n.
+static void accumulatePair(int32_t* acc, const int16_t* a, const int16_t* b,
+                           int16_t ca, int16_t cb, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  __m128i c = _mm_setr_epi16(ca, cb, ca, cb, ca, cb, ca, cb);
+  for (; x + 8 <= n; x += 8) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), c);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), c);
+    __m128i* p = (__m128i*)(acc + x);
+    _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), lo));
+    _mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), hi));
+  }
+#endif
+  for (; x < n; x++) acc[x] += ca * a[x] + cb * b[x];
+}
+
+// acc[x] += sum of c[i]*src[x+i] over 0 <= i < taps, for 0 <= x < n.
+static void accumulateTaps(int32_t* acc, const int16_t* src,
+                           const int16_t* c, int taps, int n) {
+  for (int x0 = 0; x0 < n; x0 += CONVBLOCK) {
+    int m = (n - x0 < CONVBLOCK) ? n - x0 : CONVBLOCK;
+    for (int i = 0; i < taps; i += 2) {
+      // An odd last tap is paired with itself, with weight 0
+      int j = (i + 1 < taps) ? i + 1 : i;
+      int16_t cj = (i + 1 < taps) ? c[i + 1] : 0;
+      accumulatePair(acc + x0, src + x0 + i, src + x0 + j, c[i], cj, m);
+    }
+  }
+}
+
+// acc[x] += sum of c[k]*rows[k][x] over 0 <= k < nrows, for 0 <= x < n.
+static void accumulateRows(int32_t* acc, const int16_t* const* rows,
+                           const int16_t* c, int nrows, int n) {
+  for (int x0 = 0; x0 < n; x0 += CONVBLOCK) {
+    int m = (n - x0 < CONVBLOCK) ? n - x0 : CONVBLOCK;
+    for (int k = 0; k < nrows; k += 2) {
+      int j = (k + 1 < nrows) ? k + 1 : k;
+      int16_t cj = (k + 1 < nrows) ? c[k + 1] : 0;
+      accumulatePair(acc + x0, rows[k] + x0, rows[j] + x0, c[k], cj, m);
+    }
+  }
+}
+
+// Largest shift (up to 24) for which the n weights w, scaled by 2^shift,
+// fit in int16, and sums of inmax times their absolute values fit in
+// 2^30.  Returns -1 if not even shift 0 works.
+static int convShift(const double* w, int n, double inmax) {
+  double maxabs = 0.0, sumabs = 0.0;
+  for (int i = 0; i < n; i++) {
+    double a = fabs(w[i]);
+    if (a > maxabs) maxabs = a;
+    sumabs += a;
+  }
+  if (maxabs > 32767.0 || sumabs * inmax > 1073741824.0) return -1;
+  int shift = 0;
+  while (shift < 24 && maxabs * 2.0 * (1 << shift) <= 32767.0 &&
+         sumabs * inmax * 2.0 * (1 << shift) <= 1073741824.0) {
+    shift++;
+  }
+  return shift;
+}
+
+// Scale the n weights w by 2^shift and round them to q.
+static void convQuantize(const double* w, int n, int shift, int16_t* q) {
+  for (int i = 0; i < n; i++) q[i] = (int16_t)lround(ldexp(w[i], shift));
+}
+
+// Round acc/2^shift, scaled by factor, to the nearest integer.
+static inline long convRound(int32_t acc, int shift, double factor) {
+  if (factor == 1.0) {
+    return (shift > 0) ? (acc + (1 << (shift - 1))) >> shift : acc;
+  }
+  return (long)floor(ldexp(acc * factor, -shift) + 0.5);
+}
+
+// Factor that renormalizes a border result: total weight over the weight
+// of the taps that fall inside the image (1 if either is 0).
+static inline double convFactor(double total, double inside) {
+  return (total != 0.0 && inside != 0.0) ? total / inside : 1.0;
+}
+
+// If kernel (kw x kh) has rank 1, set col[kh] and row[kw] such that
+// kernel[j*kw+i] == col[j]*row[i] (up to rounding) and return 1.
+static int convSeparable(const double* kernel, int kw, int kh, double* col, double* row) {
+  int p = 0;
+  for (int k = 1; k < kw * kh; k++) {
+    if (fabs(kernel[k]) > fabs(kernel[p])) p = k;
+  }
+  double pivot = kernel[p];
+  if (pivot == 0.0) return 0;
+  int py = p / kw, px = p % kw;
+  for (int i = 0; i < kw; i++) row[i] = kernel[py * kw + i] / pivot;
+  for (int j = 0; j < kh; j++) col[j] = kernel[j * kw + px];
+  double tol = 1e-9 * fabs(pivot);
+  for (int j = 0; j < kh; j++) {
+    for (int i = 0; i < kw; i++) {
+      if (fabs(kernel[j * kw + i] - col[j] * row[i]) > tol) return 0;
+    }
+  }
+  return 1;
+}
+
+// Working memory of a convolution.
+struct convWork {
+  int16_t* ring;    // last kh input rows (or horizontal results)
+  int16_t* line;    // one input row, widened and zero-padded
+  int32_t* acc;     // accumulators for one row
+  double* prefix;   // prefix sums of the kernel weights
+  double* col;      // separable factors of the kernel: column...
+  double* row;      // ...and row
+  int16_t* q;       // quantized weights (kernel, or col then row)
+  const int16_t** rows;  // rows of the ring used for an output row
+  int16_t* coef;         // and their quantized weights
+};
+
+static void convFree(struct convWork* cw) {
+  free(cw->ring);
+  free(cw->line);
+  free(cw->acc);
+  free(cw->prefix);
+  free(cw->col);
+  free(cw->row);
+  free(cw->q);
+  free(cw->rows);
+  free(cw->coef);
+}
+
+// Widen row src (n pixels) into line, which has rx zeros on each side.
+static void convWiden(int16_t* line, const uint8* src, int n, int rx) {
+  memset(line, 0, (size_t)rx * sizeof(int16_t));
+  for (int x = 0; x < n; x++) line[rx + x] = src[x];
+  memset(line + rx + n, 0, (size_t)(rx + 1) * sizeof(int16_t));
+}
+
+// Horizontal pass of a separable convolution over src, with weights row
+// (kw of them, quantized as q with shift, adding up to total, or 0 if
+// borders are not to be renormalized).  The result is stored in dst in
+// fixed point with frac fractional bits.
+static void convRowPass(struct convWork* cw, const uint8* src, int width,
+                        const double* row, const int16_t* q, int kw,
+                        int shift, int frac, double total, int16_t* dst) {
+  int rx = kw / 2;
+  convWiden(cw->line, src, width, rx);
+  memset(cw->acc, 0, (size_t)width * sizeof(int32_t));
+  accumulateTaps(cw->acc, cw->line, q, kw, width);
+  for (int x = 0; x < width; x++) {
+    double factor = 1.0;
+    if (x < rx || x >= width - rx) {
+      int i0 = (x < rx) ? rx - x : 0;
+      int i1 = (x + rx >= width) ? width - 1 - x + rx : kw - 1;
+      double inside = 0.0;
+      for (int i = i0; i <= i1; i++) inside += row[i];
+      factor = convFactor(total, inside);
+    }
+    long v = convRound(cw->acc[x], shift - frac, factor);
+    dst[x] = (int16_t)((v < -32768) ? -32768 : (v > 32767) ? 32767 : v);
+  }
+}
+
+/// Convolve an image with a kernel.
+/// kernel holds kh rows of kw weights: each pixel (x, y) becomes the sum
+/// of kernel[j*kw+i] times pixel (x+i-kw/2, y+j-kh/2), for all i, j,
+/// rounded to the nearest integer and saturated to [0, maxval].
+/// Like in ImageBlur, only the pixels inside the image are used: when the
+/// kernel weights do not add up to 0, results near the borders are
+/// rescaled by the total weight over the weight of the pixels used.
+/// Kernels of rank 1 (like the Gaussian) are detected and applied as a
+/// horizontal and a vertical pass.
+/// Weights are applied in fixed point, with about 4 significant digits.
+/// Requires: kw and kh odd and positive, weights at most 32767 in
+/// absolute value, adding up to at most 4210752 in absolute value.
+/// The image is changed in-place.
+/// If the working memory cannot be allocated, the image is left unchanged
+/// and errCause is set.
+void ImageConvolve(Image img, const double* kernel, int kw, int kh) { ///
+  assert (img != NULL);
+  assert (kernel != NULL);
+  assert (kw > 0 && kw % 2 == 1);
+  assert (kh > 0 && kh % 2 == 1);
+  int width = img->width;
+  int height = img->height;
+  int rx = kw / 2, ry = kh / 2;
+  uint8 maxval = img->maxval;
+  int nring = (kh < height) ? kh : height;
+  size_t linelen = (size_t)width + 2 * rx + 1;
+  double total = 0.0;
+  for (int k = 0; k < kw * kh; k++) total += kernel[k];
+
+  struct convWork cw;
+  cw.ring = (int16_t*)malloc((size_t)nring * linelen * sizeof(int16_t) + 1);
+  cw.line = (int16_t*)malloc(linelen * sizeof(int16_t));
+  cw.acc = (int32_t*)malloc((size_t)width * sizeof(int32_t) + 1);
+  cw.prefix = (double*)calloc((size_t)(kw + 1) * (kh + 1), sizeof(double));
+  cw.col = (double*)malloc((size_t)kh * sizeof(double));
+  cw.row = (double*)malloc((size_t)kw * sizeof(double));
+  cw.q = (int16_t*)malloc((size_t)(kw * kh + kw + kh) * sizeof(int16_t));
+  cw.rows = (const int16_t**)malloc((size_t)kh * sizeof(int16_t*));
+  cw.coef = (int16_t*)malloc((size_t)kh * sizeof(int16_t));
+  if (!check( cw.ring != NULL && cw.line != NULL && cw.acc != NULL &&
+              cw.prefix != NULL && cw.col != NULL && cw.row != NULL &&
+              cw.q != NULL && cw.rows != NULL && cw.coef != NULL,
+              "Failed to allocate memory in ImageConvolve" ) ||
+      !prepareWrite(img)) {
+    convFree(&cw);
+    return;
+  }
+  double* col = cw.col;
+  double* row = cw.row;
+  int16_t* q = cw.q;
+  int16_t* qcol = cw.q;
+  int16_t* qrow = cw.q + kh;
+
+  int frac = 0, hshift = 0, vshift = 0, shift = 0;
+  double htotal = 0.0, vtotal = 0.0;
+  int separable = kw > 1 && kh > 1 && convSeparable(kernel, kw, kh, col, row);
+  if (separable) {
+    // Horizontal results keep as many fractional bits as fit in int16
+    double hmax = 0.0;
+    for (int i = 0; i < kw; i++) hmax += fabs(row[i]);
+    while (frac < 8 && hmax * PixMax * (2 << frac) <= 32767.0) frac++;
+    hshift = convShift(row, kw, PixMax);
+    vshift = convShift(col, kh, 32768.0);
+    separable = hmax * PixMax <= 32767.0 && hshift >= frac && vshift >= 0;
+  }
+  if (separable) {
+    convQuantize(col, kh, vshift, qcol);
+    convQuantize(row, kw, hshift, qrow);
+    if (total != 0.0) {
+      for (int i = 0; i < kw; i++) htotal += row[i];
+      for (int j = 0; j < kh; j++) vtotal += col[j];
+    }
+  } else {
+    shift = convShift(kernel, kw * kh, PixMax);
+    assert (shift >= 0);
+    convQuantize(kernel, kw * kh, shift, q);
+  }
+
+  // prefix[j*(kw+1)+i] = sum of the weights in rows [0, j[ and columns [0, i[
+  double* prefix = cw.prefix;
+  for (int j = 0; j < kh; j++) {
+    for (int i = 0; i < kw; i++) {
+      prefix[(j + 1) * (kw + 1) + i + 1] = kernel[j * kw + i] +
+        prefix[j * (kw + 1) + i + 1] + prefix[(j + 1) * (kw + 1) + i] - prefix[j * (kw + 1) + i];
+    }
+  }
+
+  // The image is processed in place, like in ImageBlur: output row y is
+  // written after input row y+ry was saved in the ring.
+  const int16_t** rows = cw.rows;
+  int16_t* coef = cw.coef;
+  int in = 0;
+  for (int y = 0; y < height; y++) {
+    int last = (y + ry < height) ? y + ry : height - 1;
+    for (; in <= last; in++) {
+      const uint8* src = img->pixel + (size_t)in * img->stride;
+      int16_t* slot = cw.ring + (size_t)(in % nring) * linelen;
+      if (separable) {
+        convRowPass(&cw, src, width, row, qrow, kw, hshift, frac, htotal, slot);
+      } else {
+        convWiden(slot, src, width, rx);
+      }
+    }
+    int j0 = (y < ry) ? ry - y : 0;
+    int j1 = (y + ry >= height) ? height - 1 - y + ry : kh - 1;
+    uint8* dst = img->pixel + (size_t)y * img->stride;
+    memset(cw.acc, 0, (size_t)width * sizeof(int32_t));
+    if (separable) {
+      int n = 0;
+      double inside = 0.0;
+      for (int j = j0; j <= j1; j++) {
+        rows[n] = cw.ring + (size_t)((y + j - ry) % nring) * linelen;
+        coef[n++] = qcol[j];
+        inside += col[j];
+      }
+      accumulateRows(cw.acc, rows, coef, n, width);
+      double factor = (j0 > 0 || j1 < kh - 1) ? convFactor(vtotal, inside) : 1.0;
+      for (int x = 0; x < width; x++) {
+        long v = convRound(cw.acc[x], vshift + frac, factor);
+        dst[x] = (uint8)((v < 0) ? 0 : (v > maxval) ? maxval : v);
+      }
+    } else {
+      for (int j = j0; j <= j1; j++) {
+        const int16_t* line = cw.ring + (size_t)((y + j - ry) % nring) * linelen;
+        accumulateTaps(cw.acc, line, q + j * kw, kw, width);
+      }
+      int yborder = j0 > 0 || j1 < kh - 1;
+      for (int x = 0; x < width; x++) {
+        double factor = 1.0;
+        if (yborder || x < rx || x >= width - rx) {
+          int i0 = (x < rx) ? rx - x : 0;
+          int i1 = (x + rx >= width) ? width - 1 - x + rx : kw - 1;
+          double inside = prefix[(j1 + 1) * (kw + 1) + i1 + 1] - prefix[j0 * (kw + 1) + i1 + 1]
+                        - prefix[(j1 + 1) * (kw + 1) + i0] + prefix[j0 * (kw + 1) + i0];
+          factor = convFactor(total, inside);
+        }
+        long v = convRound(cw.acc[x], shift, factor);
+        dst[x] = (uint8)((v < 0) ? 0 : (v > maxval) ? maxval : v);
+      }
     }
   }
-
-  // Retorna a imagem rotacionada
-  return rotatedImage;
+  convFree(&cw);
+  PIXMEM += 2ul * width * height;  // count pixel memory accesses
 }
 
 
-/// Mirror an image = flip left-right.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-
-Image ImageMirror(Image img) {                               
-  assert(img != NULL);
-
-  // Cria uma nova imagem com as mesmas dimensões e valores máximos
-  Image mirroredImg = ImageCreate(img->width, img->height, img->maxval);
-
-  // Se falhar na criação da nova imagem, retorna NULL
-  if (mirroredImg == NULL) {
-    errCause = "Memory allocation error (ImageMirror)";
-    return NULL;
+// Gaussian blur by iterated extended box filters.
+// An extended box filter of radius r and extra weight alpha has weights
+// [alpha, 1, ..., 1, alpha] over 2r+3 taps (normalized).  Three of them in
+// sequence, with r and alpha chosen so that each one has variance
+// sigma^2/3, approximate a Gaussian very closely, and each costs O(1) per
+// pixel thanks to running sums (Gwosdek et al., "Theoretical foundations
+// of Gaussian convolution by extended box filtering", 2011).
+// The image is filtered GAUSSLANES rows at a time, and then GAUSSLANES
+// columns at a time, interleaved in a float scratch buffer so that the
+// inner loops run over the lanes with a fixed count and vectorize.
+
+#define GAUSSPASSES 3
+#define GAUSSLANES 32
+
+// Apply an extended box filter (r, alpha) along n positions of GAUSSLANES
+// lanes: out[i][c] is the weighted mean of in[j][c] over the taps j.
+// Like in ImageBlur, only positions inside [0, n[ are used.
+static void extendedBox(const float (*restrict in)[GAUSSLANES],
+                        float (*restrict out)[GAUSSLANES],
+                        int n, int r, float alpha) {
+  float sum[GAUSSLANES];   // running sums over the core window [i-r, i+r]
+  for (int c = 0; c < GAUSSLANES; c++) sum[c] = 0.0f;
+  for (int j = 0; j <= r && j < n; j++) {
+    for (int c = 0; c < GAUSSLANES; c++) sum[c] += in[j][c];
   }
-
-  //Percorre img
-  for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
-      // Calcula a posição espelhada
-      int mirroredX = img->width - 1 - x;
-      
-      // Obtém o valor do pixel na posição original e
-      // Define o valor do pixel na posição espelhada
-      ImageSetPixel(mirroredImg, mirroredX, y, ImageGetPixel(img, x, y));
+  float interior = 1.0f / (2 * r + 1 + 2 * alpha);
+  for (int i = 0; i < n; i++) {
+    int lo = i - r - 1;   // extra taps
+    int hi = i + r + 1;
+    if (i > 0 && lo >= 0 && hi <= n) {
+      for (int c = 0; c < GAUSSLANES; c++) sum[c] += in[hi - 1][c] - in[lo][c];
+    } else if (i > 0) {
+      if (hi - 1 < n) {
+        for (int c = 0; c < GAUSSLANES; c++) sum[c] += in[hi - 1][c];
+      }
+      if (lo >= 0) {
+        for (int c = 0; c < GAUSSLANES; c++) sum[c] -= in[lo][c];
+      }
+    }
+    if (lo >= 0 && hi < n) {
+      for (int c = 0; c < GAUSSLANES; c++) {
+        out[i][c] = (sum[c] + alpha * (in[lo][c] + in[hi][c])) * interior;
+      }
+    } else {
+      // Near the ends: weigh only the taps inside
+      int first = (i - r < 0) ? 0 : i - r;
+      int last = (i + r >= n) ? n - 1 : i + r;
+      float scale = 1.0f / ((last - first + 1) + alpha * ((lo >= 0) + (hi < n)));
+      for (int c = 0; c < GAUSSLANES; c++) {
+        float v = sum[c];
+        if (lo >= 0) v += alpha * in[lo][c];
+        if (hi < n) v += alpha * in[hi][c];
+        out[i][c] = v * scale;
+      }
     }
   }
-  return mirroredImg;
 }
 
-/// Crop a rectangular subimage from img.
-/// The rectangle is specified by the top left corner coords (x, y) and
-/// width w and height h.
-/// Requires:
-///   The rectangle must be inside the original image.
-/// Ensures:
-///   The original img is not modified.
-///   The returned image has width w and height h.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+// Filter line (n positions) with the GAUSSPASSES extended box filters,
+// using tmp as scratch.  Returns the buffer with the result (line or tmp).
+static float (*gaussLine(float (*line)[GAUSSLANES], float (*tmp)[GAUSSLANES],
+                         int n, int r, float alpha))[GAUSSLANES] {
+  for (int pass = 0; pass < GAUSSPASSES; pass++) {
+    extendedBox((const float (*)[GAUSSLANES])line, tmp, n, r, alpha);
+    float (*t)[GAUSSLANES] = line; line = tmp; tmp = t;
+  }
+  return line;
+}
 
-                                                                    
+// Round v to the nearest level, at most maxval.
+static inline uint8 gaussLevel(float v, uint8 maxval) {
+  int level = (int)(v + 0.5f);
+  return (uint8)((level < 0) ? 0 : (level > maxval) ? maxval : level);
+}
 
-Image ImageCrop(Image img, int x, int y, int w, int h) {
-  assert(img != NULL);
-  assert(ImageValidRect(img, x, y, w, h));
+// Load the first n pixels of m rows (at p, with stride) into the lanes:
+// lanes[x][c] = pixel x of row c, or 0 for c >= m.
+// Whole groups of 16 rows are transposed in 16x16 blocks.
+static void gaussLoadRows(float (*lanes)[GAUSSLANES], const uint8* p, size_t stride,
+                          int m, int n) {
+  for (int g = 0; g < GAUSSLANES; g += 16) {
+    const uint8* rows = p + g * stride;
+    int x = 0;
+#ifdef __SSE2__
+    uint8 block[16][16];
+    for (; g + 16 <= m && x + 16 <= n; x += 16) {
+      transpose16(rows + x, (ptrdiff_t)stride, &block[0][0], 16);
+      for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 16; c++) lanes[x + i][g + c] = block[i][c];
+      }
+    }
+#endif
+    for (; x < n; x++) {
+      for (int c = 0; c < 16; c++) lanes[x][g + c] = (g + c < m) ? rows[c * stride + x] : 0;
+    }
+  }
+}
 
-  // Cria uma nova imagem para armazenar a subimagem cortada
-  Image croppedImg = ImageCreate(w, h, img->maxval);
-  if (croppedImg == NULL) {
-    errCause = "Memory allocation error (ImageCrop)";
-    return NULL;
+// Store the lanes back into the first n pixels of m rows (at p, with
+// stride), as levels at most maxval: the reverse of gaussLoadRows.
+static void gaussStoreRows(float (*lanes)[GAUSSLANES], uint8* p, size_t stride,
+                           int m, int n, uint8 maxval) {
+  for (int g = 0; g < GAUSSLANES && g < m; g += 16) {
+    uint8* rows = p + g * stride;
+    int x = 0;
+#ifdef __SSE2__
+    uint8 block[16][16];
+    for (; g + 16 <= m && x + 16 <= n; x += 16) {
+      for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 16; c++) block[i][c] = gaussLevel(lanes[x + i][g + c], maxval);
+      }
+      transpose16(&block[0][0], 16, rows + x, (ptrdiff_t)stride);
+    }
+#endif
+    for (; x < n; x++) {
+      for (int c = 0; g + c < m && c < 16; c++) rows[c * stride + x] = gaussLevel(lanes[x][g + c], maxval);
+    }
   }
+}
 
-  // Copia os pixels da subimagem para a nova imagem
-  for (int dy = 0; dy < h; dy++) {
-    for (int dx = 0; dx < w; dx++) {
-      int srcX = x + dx;
-      int srcY = y + dy;
-      int destIndex = dy * w + dx;
-      int srcIndex = srcY * img->width + srcX;
+// A Gaussian blur job, shared by the worker threads.
+// The rows are filtered in groups of GAUSSLANES (tasks of phase 0) and
+// then the columns, in strips of GAUSSLANES (tasks of phase 1).
+struct gaussJob {
+  Image img;
+  int r;                    // box filter radius
+  float alpha;              // and extra weight
+  int phase;                // 0: rows, 1: columns
+  int ntasks;               // groups of rows or strips of columns
+  int next;                 // next task
+  pthread_mutex_t lock;     // protects next
+};
 
-      // Garante que os índices são válidos
-      assert(srcX >= 0 && srcX < img->width);
-      assert(srcY >= 0 && srcY < img->height);
+// A worker thread of a Gaussian blur job, with its own scratch space.
+struct gaussWorker {
+  struct gaussJob* job;
+  float (*line)[GAUSSLANES];  // 2*max(width, height) positions
+};
 
-      // Copia o pixel da subimagem para a nova imagem
-      croppedImg->pixel[destIndex] = img->pixel[srcIndex];
+// Filter the rows (or columns) of task t of job, using scratch line.
+static void gaussTask(struct gaussJob* job, int t, float (*line)[GAUSSLANES]) {
+  Image img = job->img;
+  int width = img->width;
+  int height = img->height;
+  size_t stride = (size_t)img->stride;
+  uint8 maxval = img->maxval;
+  size_t n = (width > height) ? (size_t)width : (size_t)height;
+  float (*tmp)[GAUSSLANES] = line + n;
+
+  if (job->phase == 0) {
+    int y0 = t * GAUSSLANES;
+    int m = (height - y0 < GAUSSLANES) ? height - y0 : GAUSSLANES;
+    uint8* rows = img->pixel + y0 * stride;
+    gaussLoadRows(line, rows, stride, m, width);
+    float (*result)[GAUSSLANES] = gaussLine(line, tmp, width, job->r, job->alpha);
+    gaussStoreRows(result, rows, stride, m, width, maxval);
+  } else {
+    int x0 = t * GAUSSLANES;
+    int m = (width - x0 < GAUSSLANES) ? width - x0 : GAUSSLANES;
+    if (m < GAUSSLANES) memset(line, 0, (size_t)height * sizeof(*line));
+    for (int y = 0; y < height; y++) {
+      const uint8* p = img->pixel + y * stride + x0;
+      if (m == GAUSSLANES) {
+        for (int c = 0; c < GAUSSLANES; c++) line[y][c] = p[c];
+      } else {
+        for (int c = 0; c < m; c++) line[y][c] = p[c];
+      }
+    }
+    float (*result)[GAUSSLANES] = gaussLine(line, tmp, height, job->r, job->alpha);
+    for (int y = 0; y < height; y++) {
+      uint8* p = img->pixel + y * stride + x0;
+      if (m == GAUSSLANES) {
+        for (int c = 0; c < GAUSSLANES; c++) p[c] = gaussLevel(result[y][c], maxval);
+      } else {
+        for (int c = 0; c < m; c++) p[c] = gaussLevel(result[y][c], maxval);
+      }
     }
   }
-
-  return croppedImg;
 }
 
+// Worker of ImageGaussianBlur: do tasks of the current phase until none
+// is left.
+static void* gaussRun(void* arg) {
+  struct gaussWorker* worker = (struct gaussWorker*)arg;
+  struct gaussJob* job = worker->job;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    int t = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (t >= job->ntasks) break;
+    gaussTask(job, t, worker->line);
+  }
+  return NULL;
+}
 
-/// Operations on two images
-
-/// Paste an image into a larger image.
-/// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) {                       
-  assert(img1 != NULL); 
-  assert(img2 != NULL);
-  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+// Images smaller than this (in pixels) are blurred by a single thread.
+#define GAUSSTHREADED (1 << 20)
+
+/// Blur an image with a Gaussian filter of standard deviation sigma.
+/// The filter is approximated by three extended box filters, so the cost
+/// per pixel does not depend on sigma.
+/// Like in ImageBlur, only the pixels inside the image are used near the
+/// borders.
+/// Large images are processed by a pool of threads, one per available
+/// processor.
+/// Requires: sigma >= 0.
+/// The image is changed in-place.
+/// If the working memory (a few rows or columns of floats) cannot be
+/// allocated, the image is left unchanged and errCause is set.
+void ImageGaussianBlur(Image img, double sigma) { ///
+  assert (img != NULL);
+  assert (sigma >= 0.0);
+  int width = img->width;
+  int height = img->height;
+  if (sigma == 0.0 || width == 0 || height == 0) return;
+
+  // Each box filter has variance s = sigma^2/GAUSSPASSES: r is the largest
+  // radius of a plain box with variance r(r+1)/3 <= s, and alpha makes up
+  // the difference.
+  double s = sigma * sigma / GAUSSPASSES;
+  int r = (int)floor(0.5 * sqrt(12.0 * s + 1.0) - 0.5);
+  float alpha = (float)((2 * r + 1) * (s - r * (r + 1) / 3.0) /
+                        (2.0 * ((r + 1) * (r + 1) - s)));
+
+  // One scratch buffer per thread; use fewer threads if memory is short
+  int nrows = (height + GAUSSLANES - 1) / GAUSSLANES;
+  int ncols = (width + GAUSSLANES - 1) / GAUSSLANES;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = (ncpu < 1) ? 1 : (ncpu > 64) ? 64 : (int)ncpu;
+  if ((long)width * height < GAUSSTHREADED) nthreads = 1;
+  if (nthreads > nrows && nthreads > ncols) nthreads = (nrows > ncols) ? nrows : ncols;
+  size_t n = (width > height) ? (size_t)width : (size_t)height;
+  struct gaussJob job = { img, r, alpha, 0, 0, 0 };
+  struct gaussWorker workers[64];
+  int nbuf = 0;
+  while (nbuf < nthreads &&
+         (workers[nbuf].line = malloc(2 * n * sizeof(*workers[nbuf].line))) != NULL) {
+    workers[nbuf++].job = &job;
+  }
+  if (!check( nbuf > 0, "Failed to allocate memory in ImageGaussianBlur" ) ||
+      !prepareWrite(img)) {
+    while (nbuf > 0) free(workers[--nbuf].line);
+    return;
+  }
+  nthreads = nbuf;
+
+  pthread_mutex_init(&job.lock, NULL);
+  for (job.phase = 0; job.phase < 2; job.phase++) {
+    // All rows must be done before the columns start
+    job.ntasks = (job.phase == 0) ? nrows : ncols;
+    job.next = 0;
+    pthread_t tid[64];
+    int started = 0;
+    // The calling thread is one of the workers
+    while (started < nthreads - 1 &&
+           pthread_create(&tid[started], NULL, gaussRun, &workers[started + 1]) == 0) {
+      started++;
+    }
+    gaussRun(&workers[0]);
+    for (int t = 0; t < started; t++) {
+      pthread_join(tid[t], NULL);
+    }
+  }
+  pthread_mutex_destroy(&job.lock);
+  for (int t = 0; t < nbuf; t++) free(workers[t].line);
+  PIXMEM += 4ul * width * height;  // count pixel memory accesses
+}
 
-  // Iterar sobre os pixels de img2 e colá-los em img1 na posição adequada
-  for (int newY = 0; newY < img2->height; ++newY) {
-    for (int newX = 0; newX < img2->width; ++newX) {
-      // Calcular as coordenadas correspondentes em img1
-      int destX = x + newX;
-      int destY = y + newY;
 
-      // Verificar se as coordenadas de destino são válidas em img1
-      assert(ImageValidPos(img1, destX, destY));
+// Median filter in O(1) per pixel (Perreault and Hebert, "Median
+// filtering in constant time", 2007).
+// Each column x keeps a histogram of its pixels in the rows of the window,
+// and moving the window down one row adds one pixel to and removes one
+// pixel from each column histogram.  Along a row, the window histogram is
+// updated by adding the column histogram entering on the right and
+// subtracting the one leaving on the left, 256 bins at a time in loops
+// the compiler vectorizes.  Coarse histograms of 16 bins of 16 levels
+// each locate the median quickly.
+
+// Histogram of a column of the window.
+struct medianColumn {
+  uint16_t fine[256];
+  uint16_t coarse[16];
+};
 
-      // Obter o valor do pixel em img2
-      uint8 pixelValue = ImageGetPixel(img2, newX, newY);
+// h += a - b, for a, b column histograms (either may be NULL).
+static void medianUpdate(uint32_t* fine, uint32_t* coarse,
+                         const struct medianColumn* a, const struct medianColumn* b) {
+  if (a != NULL && b != NULL) {
+    for (int v = 0; v < 256; v++) fine[v] += (uint32_t)a->fine[v] - b->fine[v];
+    for (int k = 0; k < 16; k++) coarse[k] += (uint32_t)a->coarse[k] - b->coarse[k];
+  } else if (a != NULL) {
+    for (int v = 0; v < 256; v++) fine[v] += a->fine[v];
+    for (int k = 0; k < 16; k++) coarse[k] += a->coarse[k];
+  } else if (b != NULL) {
+    for (int v = 0; v < 256; v++) fine[v] -= b->fine[v];
+    for (int k = 0; k < 16; k++) coarse[k] -= b->coarse[k];
+  }
+}
 
-      // Colar o pixel em img1 na posição correspondente
-      ImageSetPixel(img1, destX, destY, pixelValue);
-    }
+// Add (delta = 1) or remove (delta = -1) the n pixels of row to the
+// column histograms.
+static void medianRow(struct medianColumn* cols, const uint8* row, int n, int delta) {
+  for (int x = 0; x < n; x++) {
+    cols[x].fine[row[x]] += delta;
+    cols[x].coarse[row[x] >> 4] += delta;
   }
 }
 
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (only the pixels inside the image, like in
+/// ImageBlur).  When that rectangle has an even number of pixels, the
+/// lower of the two middle levels is taken.
+/// The cost per pixel does not depend on dx and dy.
+/// Requires: dx >= 0, 0 <= dy < 32768.
+/// The image is changed in-place.
+/// If the working memory (a histogram per column and about dy rows) cannot
+/// be allocated, the image is left unchanged and errCause is set.
+void ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0);
+  assert (0 <= dy && dy < 32768);
+  int width = img->width;
+  int height = img->height;
 
-/// Blend an image into a larger image.
-/// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-/// alpha usually is in [0.0, 1.0], but values outside that interval
-/// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {     
-  assert (img1 != NULL);
-  assert (img2 != NULL);
-  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  //assert(alpha >= 0.0 && alpha <= 1.0);
+  // Original rows y-dy-1 ... y-1 are kept in a ring: the image rows are
+  // already replaced by their output when they leave the window.
+  int nring = (dy + 1 < height) ? dy + 1 : height;
+  struct medianColumn* cols = calloc((size_t)width + 1, sizeof(struct medianColumn));
+  uint8* ring = malloc((size_t)nring * width + 1);
+  if (!check( cols != NULL && ring != NULL, "Failed to allocate memory in ImageMedian" ) ||
+      !prepareWrite(img)) {
+    free(cols);
+    free(ring);
+    return;
+  }
+  size_t stride = (size_t)img->stride;
 
-  // Percorre os pixels de img2 e mistura no local apropriado em img1
-  for (int i = 0; i < img2->height; ++i) {
-    for (int j = 0; j < img2->width; ++j) {
-      // Calcula a posição correspondente em img1
-      int img1_x = x + j;
-      int img1_y = y + i;
+  uint32_t fine[256];
+  uint32_t coarse[16];
+  for (int y = 0; y < height && y <= dy; y++) {
+    medianRow(cols, img->pixel + y * stride, width, 1);
+  }
+  for (int y = 0; y < height; y++) {
+    // Move the column histograms to rows [y-dy, y+dy]
+    if (y > 0 && y + dy < height) {
+      medianRow(cols, img->pixel + (y + dy) * stride, width, 1);
+    }
+    if (y - dy - 1 >= 0) {
+      medianRow(cols, ring + (size_t)((y - dy - 1) % nring) * width, width, -1);
+    }
+    int y1 = (y - dy < 0) ? 0 : y - dy;
+    int y2 = (y + dy >= height) ? height - 1 : y + dy;
+    uint32_t rows = (uint32_t)(y2 - y1 + 1);
 
-      // Verifica se a posição está dentro dos limites de img1
-      if (ImageValidPos(img1, img1_x, img1_y)) {
-        // Obtém os valores dos pixels de img1 e img2
-        uint8 pixel1 = ImageGetPixel(img1, img1_x, img1_y);
-        uint8 pixel2 = ImageGetPixel(img2, j, i);
+    // Window histogram of x = 0: columns [0, dx]
+    memset(fine, 0, sizeof(fine));
+    memset(coarse, 0, sizeof(coarse));
+    for (int x = 0; x <= dx && x < width; x++) medianUpdate(fine, coarse, &cols[x], NULL);
 
-        // Calcula o valor blend e atualiza o pixel em img1
-        double aux = (1.0 - alpha) * pixel1 + alpha * pixel2;
-        int8_t blended_pixel = (uint8_t)round(aux);
-        ImageSetPixel(img1, img1_x, img1_y, blended_pixel);
+    uint8* row = img->pixel + y * stride;
+    memcpy(ring + (size_t)(y % nring) * width, row, width);
+    for (int x = 0; x < width; x++) {
+      if (x > 0) {
+        medianUpdate(fine, coarse, (x + dx < width) ? &cols[x + dx] : NULL,
+                     (x - dx - 1 >= 0) ? &cols[x - dx - 1] : NULL);
       }
+      int x1 = (x - dx < 0) ? 0 : x - dx;
+      int x2 = (x + dx >= width) ? width - 1 : x + dx;
+      uint32_t target = (rows * (uint32_t)(x2 - x1 + 1) + 1) / 2;  // rank of the median
+      uint32_t count = 0;
+      int k = 0;
+      while (count + coarse[k] < target) count += coarse[k++];
+      int v = 16 * k;
+      while (count + fine[v] < target) count += fine[v++];
+      row[x] = (uint8)v;
     }
   }
+  free(cols);
+  free(ring);
+  PIXMEM += 2ul * width * height;  // count pixel memory accesses
 }
 
 
-/// Compare an image to a subimage of a larger image.
-/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  assert(ImageValidPos(img1, x, y));
-
-  int subimgWidth = ImageWidth(img2);
-  int subimgHeight = ImageHeight(img2);
-
-  // Verifica se a subimagem cabe dentro da imagem maior
-  if (!ImageValidRect(img1, x, y, subimgWidth, subimgHeight)) {
-    errCause = "Subimagem não cabe (ImageMatchSubImage)";
-    return 0;
+// Morphology with rectangular structuring elements.
+// Erosion (minimum) and dilation (maximum) over a rectangle are separable,
+// and each 1D pass uses the van Herk/Gil-Werman algorithm: the line is cut
+// in blocks of the window size k = 2r+1, with running extrema forward (g)
+// and backward (h) inside each block, so that the extremum of any window
+// is op(h[x-r], g[x+r]): about 3 comparisons per pixel, whatever r is.
+// Positions outside the image are padded with the neutral level of the
+// operation, so only pixels inside the image count, like in ImageBlur.
+//
+// Like ImageGaussianBlur, lines are processed MORPHLANES at a time,
+// interleaved so the inner loops run over the lanes.
+// Binary images (all levels 0 or maxval) take a fast path on rows packed
+// in 64-bit words: 64 pixels per operation.
+
+#define MORPHLANES 64
+
+// 1D van Herk/Gil-Werman pass of radius r over n positions of MORPHLANES
+// lanes, in place, with g and h as scratch for n+2r positions each.
+// Computes minima if erode, maxima otherwise.
+static void vhgwBytes(uint8 (*line)[MORPHLANES], uint8 (*g)[MORPHLANES],
+                      uint8 (*h)[MORPHLANES], int n, int r, int erode) {
+  int k = 2 * r + 1;
+  int len = n + 2 * r;   // padded line: position i is line[i-r]
+  uint8 pad[MORPHLANES];
+  memset(pad, erode ? 0xff : 0, sizeof(pad));
+  for (int i = 0; i < len; i++) {
+    const uint8* p = (i >= r && i - r < n) ? line[i - r] : pad;
+    if (i % k == 0) {
+      memcpy(g[i], p, MORPHLANES);
+    } else if (erode) {
+      for (int c = 0; c < MORPHLANES; c++) g[i][c] = (p[c] < g[i-1][c]) ? p[c] : g[i-1][c];
+    } else {
+      for (int c = 0; c < MORPHLANES; c++) g[i][c] = (p[c] > g[i-1][c]) ? p[c] : g[i-1][c];
+    }
+  }
+  for (int i = len - 1; i >= 0; i--) {
+    const uint8* p = (i >= r && i - r < n) ? line[i - r] : pad;
+    if (i % k == k - 1 || i == len - 1) {
+      memcpy(h[i], p, MORPHLANES);
+    } else if (erode) {
+      for (int c = 0; c < MORPHLANES; c++) h[i][c] = (p[c] < h[i+1][c]) ? p[c] : h[i+1][c];
+    } else {
+      for (int c = 0; c < MORPHLANES; c++) h[i][c] = (p[c] > h[i+1][c]) ? p[c] : h[i+1][c];
+    }
+  }
+  // Window of x is [x, x+2r] in padded positions
+  for (int x = 0; x < n; x++) {
+    const uint8* a = h[x];
+    const uint8* b = g[x + 2 * r];
+    if (erode) {
+      for (int c = 0; c < MORPHLANES; c++) line[x][c] = (a[c] < b[c]) ? a[c] : b[c];
+    } else {
+      for (int c = 0; c < MORPHLANES; c++) line[x][c] = (a[c] > b[c]) ? a[c] : b[c];
+    }
   }
+}
 
-  // Percorre a região correspondente na imagem maior
-  for (int i = 0; i < subimgWidth; i++) {
-    for (int j = 0; j < subimgHeight; j++) {
-      int img1PixelX = x + i;
-      int img1PixelY = y + j;
-      uint8 pixelImg1 = ImageGetPixel(img1, img1PixelX, img1PixelY);
+// Same as vhgwBytes, for lanes of nw words of packed binary pixels:
+// AND if erode, OR otherwise.
+static void vhgwWords(uint64_t* line, uint64_t* g, uint64_t* h,
+                      int n, int nw, int r, int erode) {
+  int k = 2 * r + 1;
+  int len = n + 2 * r;
+  uint64_t pad = erode ? ~(uint64_t)0 : 0;
+  for (int i = 0; i < len; i++) {
+    const uint64_t* p = (i >= r && i - r < n) ? line + (size_t)(i - r) * nw : NULL;
+    uint64_t* gi = g + (size_t)i * nw;
+    for (int c = 0; c < nw; c++) {
+      uint64_t v = (p != NULL) ? p[c] : pad;
+      if (i % k != 0) v = erode ? (v & gi[c - nw]) : (v | gi[c - nw]);
+      gi[c] = v;
+    }
+  }
+  for (int i = len - 1; i >= 0; i--) {
+    const uint64_t* p = (i >= r && i - r < n) ? line + (size_t)(i - r) * nw : NULL;
+    uint64_t* hi = h + (size_t)i * nw;
+    for (int c = 0; c < nw; c++) {
+      uint64_t v = (p != NULL) ? p[c] : pad;
+      if (i % k != k - 1 && i != len - 1) v = erode ? (v & hi[c + nw]) : (v | hi[c + nw]);
+      hi[c] = v;
+    }
+  }
+  for (int x = 0; x < n; x++) {
+    const uint64_t* a = h + (size_t)x * nw;
+    const uint64_t* b = g + (size_t)(x + 2 * r) * nw;
+    uint64_t* o = line + (size_t)x * nw;
+    for (int c = 0; c < nw; c++) o[c] = erode ? (a[c] & b[c]) : (a[c] | b[c]);
+  }
+}
 
-      uint8 pixelImg2 = ImageGetPixel(img2, i, j);
+// Word starting at bit position x (any, possibly negative or beyond the
+// row) of the packed row bits of nw words; missing bits are fill.
+static inline uint64_t bitsWord(const uint64_t* bits, int nw, long x, uint64_t fill) {
+  long q = (x >= 0) ? x / 64 : -((63 - x) / 64);   // floor(x/64)
+  int s = (int)(x - q * 64);
+  uint64_t lo = (q >= 0 && q < nw) ? bits[q] : fill;
+  if (s == 0) return lo;
+  uint64_t hi = (q + 1 >= 0 && q + 1 < nw) ? bits[q + 1] : fill;
+  return (lo >> s) | (hi << (64 - s));
+}
 
-      // Compara os pixels das duas imagens
-      if (pixelImg1 != pixelImg2) {
-        return 0; // Pixels diferentes, as imagens não coincidem
-      }
+// Erode (AND) or dilate (OR) the packed row bits (nw words) horizontally
+// with radius r.  Bits beyond the row must hold the neutral value.
+// The row is first copied to pad (pw words, at least width+2r bits) after
+// r neutral bits, so that bit x of the result is the extremum of the bits
+// [x, x+2r] of pad.  That is built by doubling: if S(w) holds at bit x the
+// extremum of bits [x, x+w-1], then S(w+s) = S(w) op (S(w) shifted by s),
+// for any s <= w.
+static void morphBitsRow(uint64_t* bits, int nw, uint64_t* pad, int pw,
+                         int r, int erode) {
+  uint64_t fill = erode ? ~(uint64_t)0 : 0;
+  for (int c = 0; c < pw; c++) pad[c] = bitsWord(bits, nw, (long)c * 64 - r, fill);
+  int k = 2 * r + 1;
+  int w = 1;
+  while (w < k) {
+    int s = (2 * w <= k) ? w : k - w;
+    for (int c = 0; c < pw; c++) {
+      // Reads words at and above c, not yet updated
+      uint64_t v = bitsWord(pad, pw, (long)c * 64 + s, fill);
+      pad[c] = erode ? (pad[c] & v) : (pad[c] | v);
     }
+    w += s;
   }
+  memcpy(bits, pad, (size_t)nw * sizeof(uint64_t));
+}
 
-  // Se chegou até aqui, as imagens coincidem
+// Is img binary, with all levels 0 or maxval?
+static int isBinary(Image img) {
+  uint8 maxval = img->maxval;
+  for (int y = 0; y < img->height; y++) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    int bad = 0;
+    for (int x = 0; x < img->width; x++) bad |= (row[x] != 0) & (row[x] != maxval);
+    if (bad) return 0;
+  }
   return 1;
 }
 
+// Erode or dilate a binary image on packed rows.
+static void morphBinary(Image img, int dx, int dy, int erode) {
+  int width = img->width;
+  int height = img->height;
+  int nw = (width + 63) / 64;
+  int pw = (width + 2 * dx + 63) / 64;
+  size_t len = (size_t)height + 2 * dy;
+  uint64_t* bits = malloc(((size_t)height * nw + 2 * len * nw + pw) * sizeof(uint64_t));
+  if (!check( bits != NULL, "Failed to allocate memory in ImageErode/ImageDilate" ) ||
+      !prepareWrite(img)) {
+    free(bits);
+    return;
+  }
+  uint64_t* g = bits + (size_t)height * nw;
+  uint64_t* h = g + len * nw;
+  uint64_t* pad = h + len * nw;
+  size_t stride = (size_t)img->stride;
+  uint8 maxval = img->maxval;
+  uint64_t fill = erode ? ~(uint64_t)0 : 0;
 
-/// Locate a subimage inside another image.
-/// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
-/// If no match is found, returns 0 and (*px, *py) are left untouched.
-int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-  uint64_t count = 0;
+  for (int y = 0; y < height; y++) {
+    const uint8* row = img->pixel + y * stride;
+    uint64_t* b = bits + (size_t)y * nw;
+    for (int c = 0; c < nw; c++) {
+      uint64_t word = fill;   // neutral bits beyond the row
+      int n = (width - 64 * c < 64) ? width - 64 * c : 64;
+      for (int i = 0; i < n; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        word = (row[64 * c + i] == maxval) ? (word | bit) : (word & ~bit);
+      }
+      b[c] = word;
+    }
+    if (dx > 0) morphBitsRow(b, nw, pad, pw, dx, erode);
+  }
+  // (bits beyond the row are no longer neutral, but columns do not mix)
+  if (dy > 0) vhgwWords(bits, g, h, height, nw, dy, erode);
+  for (int y = 0; y < height; y++) {
+    uint8* row = img->pixel + y * stride;
+    const uint64_t* b = bits + (size_t)y * nw;
+    for (int x = 0; x < width; x++) row[x] = ((b[x >> 6] >> (x & 63)) & 1) ? maxval : 0;
+  }
+  free(bits);
+}
 
-  //Ver as diferenças de tamanho entre img1 e img2
-  int height_diff = img1->height - img2->height;
-  int width_diff = img1->width - img2->width;
+// Erode (or dilate) img with a (2dx+1)x(2dy+1) rectangle.
+static void morph(Image img, int dx, int dy, int erode) {
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  int width = img->width;
+  int height = img->height;
+  // Larger radii give the same results as the whole image
+  if (dx >= width) dx = (width > 0) ? width - 1 : 0;
+  if (dy >= height) dy = (height > 0) ? height - 1 : 0;
+  if ((dx == 0 && dy == 0) || width == 0 || height == 0) return;
+  if (isBinary(img)) {
+    morphBinary(img, dx, dy, erode);
+    PIXMEM += 2ul * width * height;  // count pixel memory accesses
+    return;
+  }
 
-  for (int y = 0; y <= height_diff; ++y) {
-    for (int x = 0; x <= width_diff; ++x) {
-      count += img2->width * img2->height;
-      if (ImageMatchSubImage(img1, x, y, img2)) {
-        // Subimage found, set the matching position and return 1
-        *px = x;
-        *py = y;
-        printf("Total operations ImageLocateSubImage: %ld)\n", count);
-        return 1;
+  size_t n = (width > height) ? (size_t)width : (size_t)height;
+  size_t r = (dx > dy) ? (size_t)dx : (size_t)dy;
+  uint8 (*line)[MORPHLANES] = malloc((3 * n + 4 * r) * MORPHLANES);
+  if (!check( line != NULL, "Failed to allocate memory in ImageErode/ImageDilate" ) ||
+      !prepareWrite(img)) {
+    free(line);
+    return;
+  }
+  uint8 (*g)[MORPHLANES] = line + n;
+  uint8 (*h)[MORPHLANES] = g + n + 2 * r;
+  size_t stride = (size_t)img->stride;
+
+  // Rows, MORPHLANES at a time, transposed in 16x16 blocks
+  for (int y0 = 0; dx > 0 && y0 < height; y0 += MORPHLANES) {
+    int m = (height - y0 < MORPHLANES) ? height - y0 : MORPHLANES;
+    uint8* rows = img->pixel + y0 * stride;
+    for (int k = 0; k < 2; k++) {
+      // k = 0: load the lanes; k = 1: store them back
+      for (int c0 = 0; c0 < m; c0 += 16) {
+        int x = 0;
+#ifdef __SSE2__
+        for (; c0 + 16 <= m && x + 16 <= width; x += 16) {
+          if (k == 0) transpose16(rows + c0 * stride + x, (ptrdiff_t)stride, &line[x][c0], MORPHLANES);
+          else transpose16(&line[x][c0], MORPHLANES, rows + c0 * stride + x, (ptrdiff_t)stride);
+        }
+#endif
+        for (; x < width; x++) {
+          for (int c = c0; c < c0 + 16 && c < m; c++) {
+            if (k == 0) line[x][c] = rows[c * stride + x];
+            else rows[c * stride + x] = line[x][c];
+          }
+        }
       }
+      if (k == 0) vhgwBytes(line, g, h, width, dx, erode);
     }
   }
+  // Columns, MORPHLANES at a time
+  for (int x0 = 0; dy > 0 && x0 < width; x0 += MORPHLANES) {
+    int m = (width - x0 < MORPHLANES) ? width - x0 : MORPHLANES;
+    for (int y = 0; y < height; y++) memcpy(line[y], img->pixel + y * stride + x0, m);
+    vhgwBytes(line, g, h, height, dy, erode);
+    for (int y = 0; y < height; y++) memcpy(img->pixel + y * stride + x0, line[y], m);
+  }
+  free(line);
+  PIXMEM += 2ul * width * height;  // count pixel memory accesses
+}
 
-      // Se houver uma correspondência, define as posições e retorna 1
-  uint64_t formula = (width_diff+1)*(height_diff+1)*(img2->width*img2->height);
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (only the pixels inside the image, like in
+/// ImageBlur).
+/// The cost per pixel does not depend on dx and dy.
+/// Binary images (with all levels 0 or maxval, like the results of
+/// ImageThreshold) are processed 64 pixels at a time.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// If the working memory (a few rows or columns) cannot be allocated,
+/// the image is left unchanged and errCause is set.
+void ImageErode(Image img, int dx, int dy) { ///
+  morph(img, dx, dy, 1);
+}
 
-  printf("Total operations ImageLocateSubImage: %ld \n", formula);
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], with the same conventions as ImageErode.
+void ImageDilate(Image img, int dx, int dy) { ///
+  morph(img, dx, dy, 0);
+}
 
-  return 0;  // No match found
+/// Open an image with a (2dx+1)x(2dy+1) rectangle.
+/// This is an erosion followed by a dilation: it removes bright details
+/// smaller than the rectangle.  Same conventions as ImageErode.
+void ImageOpen(Image img, int dx, int dy) { ///
+  morph(img, dx, dy, 1);
+  morph(img, dx, dy, 0);
 }
 
+/// Close an image with a (2dx+1)x(2dy+1) rectangle.
+/// This is a dilation followed by an erosion: it fills dark details
+/// smaller than the rectangle.  Same conventions as ImageErode.
+void ImageClose(Image img, int dx, int dy) { ///
+  morph(img, dx, dy, 0);
+  morph(img, dx, dy, 1);
+}
 
-/// Filtering
+/// Summed-area tables
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+/// These allow computing statistics of any rectangle of an image in O(1),
+/// after a single pass over the image.
 
-void ImageBlur(Image img, int dx, int dy) {
-    assert (img != NULL);
-    assert (dx >= 0 && dy >= 0);
-
-    // Create a temporary image to store the blurred result
-    Image image2 = ImageCreate(img->width, img->height, img->maxval);
-
-    for (int i = 0; i < img->height; i++) {
-        for (int j = 0; j < img->width; j++) {
-            int sum = 0;
-            int count = 0;
-            for (int k = -dx; k <= dx; k++) {
-                for (int l = -dy; l <= dy; l++) {
-                    int x = j + k;
-                    int y = i + l;
-                    if (x >= 0 && x < img->width && y >= 0 && y < img->height) {
-                        sum += ImageGetPixel(img, x, y);
-                        count++;
-                    }
-                }
-            }
-            // Use round for proper rounding of the mean
-            int mean;
-            if (count > 0) {
-                mean = (int)((float)sum / count + 0.5);
-            } else {
-                mean = 0;
-            }
-            // Convert the mean back to uint8
-            uint8 meanInt = (uint8)mean;
-            ImageSetPixel(image2, j, i, meanInt);
-        }
-    }
+// Internal structure for the summed-area tables of an image.
+// Both tables have (width+1)x(height+1) entries: entry (x, y) holds the
+// sum (of levels or of squared levels) over the rectangle [0, x[ x [0, y[,
+// so that row 0 and column 0 are zero.
+struct imageIntegral {
+  int width;
+  int height;
+  uint64_t* sum;
+  uint64_t* sumsq;
+};
 
-    // Copy the blurred result back to the original image
-    for (int i = 0; i < img->height; i++) {
-        for (int j = 0; j < img->width; j++) {
-            uint8 pixelValue = ImageGetPixel(image2, j, i);
-            ImageSetPixel(img, j, i, pixelValue);
-        }
+/// Get the summed-area tables of img.
+/// The tables are computed on the first call and kept with img until its
+/// pixels are modified, so later calls are O(1).
+/// The returned object belongs to img: it must not be used after img is
+/// modified or destroyed.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIntegral ImageIntegralGet(Image img) { ///
+  assert (img != NULL);
+  if (img->integral != NULL) return img->integral;
+  int width = img->width;
+  int height = img->height;
+  size_t cols = (size_t)width + 1;
+  size_t n = cols * ((size_t)height + 1);
+  ImageIntegral ii = (ImageIntegral)malloc(sizeof(struct imageIntegral) +
+                                           2 * n * sizeof(uint64_t));
+  if (!check( ii != NULL, "Failed to allocate memory in ImageIntegralGet" )) {
+    return NULL;
+  }
+  ii->width = width;
+  ii->height = height;
+  ii->sum = (uint64_t*)(ii + 1);
+  ii->sumsq = ii->sum + n;
+
+  memset(ii->sum, 0, cols * sizeof(uint64_t));
+  memset(ii->sumsq, 0, cols * sizeof(uint64_t));
+  for (int y = 0; y < height; y++) {
+    const uint8* row = img->pixel + (size_t)y * img->stride;
+    uint64_t* sum = ii->sum + (y + 1) * cols;
+    uint64_t* sumsq = ii->sumsq + (y + 1) * cols;
+    // Prefix sums along the row...
+    uint64_t s = 0, q = 0;
+    sum[0] = sumsq[0] = 0;
+    for (int x = 0; x < width; x++) {
+      s += row[x];
+      q += (uint64_t)row[x] * row[x];
+      sum[x + 1] = s;
+      sumsq[x + 1] = q;
     }
+    // ...plus the row above, in a loop the compiler vectorizes
+    const uint64_t* above = sum - cols;
+    const uint64_t* abovesq = sumsq - cols;
+    for (size_t x = 1; x < cols; x++) {
+      sum[x] += above[x];
+      sumsq[x] += abovesq[x];
+    }
+  }
+  PIXMEM += (unsigned long)width * height;  // count pixel memory accesses
+  img->integral = ii;
+  return ii;
+}
 
-    // Destroy the temporary image
-    ImageDestroy(&image2);
+// Sum of table t over the rectangle (x, y, w, h), from its 4 corners.
+static inline uint64_t rectSum(ImageIntegral ii, const uint64_t* t,
+                               int x, int y, int w, int h) {
+  size_t cols = (size_t)ii->width + 1;
+  const uint64_t* top = t + (size_t)y * cols + x;
+  const uint64_t* bottom = top + (size_t)h * cols;
+  return bottom[w] - bottom[0] - top[w] + top[0];
 }
 
-// Função otimizada de desfoque usando imagens integrais
-void ImageBlurOptimized(Image img, int dx, int dy) {
-  assert(img != NULL);
-  assert(dx >= 0 && dy >= 0);
-  int ops = 0;
+/// Sum of the pixel levels in the rectangle (x, y, w, h).
+/// Requires: the rectangle must be inside the image of ii.
+uint64_t ImageRectSum(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (0 <= x && 0 <= w && x + w <= ii->width);
+  assert (0 <= y && 0 <= h && y + h <= ii->height);
+  return rectSum(ii, ii->sum, x, y, w, h);
+}
 
-  int width = img->width;
-  int height = img->height;
+/// Mean of the pixel levels in the rectangle (x, y, w, h).
+/// Requires: the rectangle must be inside the image of ii and not empty.
+double ImageRectMean(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (0 <= x && 0 < w && x + w <= ii->width);
+  assert (0 <= y && 0 < h && y + h <= ii->height);
+  return (double)rectSum(ii, ii->sum, x, y, w, h) / ((double)w * h);
+}
 
-  // Calcular a imagem integral
-  int* integImg;
-  CreateIntegralImage(img, &integImg);
+/// Variance of the pixel levels in the rectangle (x, y, w, h).
+/// This is the population variance: the mean of the squared deviations.
+/// Requires: the rectangle must be inside the image of ii and not empty.
+double ImageRectVariance(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (0 <= x && 0 < w && x + w <= ii->width);
+  assert (0 <= y && 0 < h && y + h <= ii->height);
+  double n = (double)w * h;
+  double sum = (double)rectSum(ii, ii->sum, x, y, w, h);
+  double sumsq = (double)rectSum(ii, ii->sumsq, x, y, w, h);
+  double var = (sumsq - sum * sum / n) / n;
+  return (var > 0.0) ? var : 0.0;  // no negative rounding errors
+}
 
 
-  if (integImg == NULL) {
-    errCause = "Memory allocation error (ImageBlurOptimized)";
-    return NULL;
-  }
+/// Image pyramids
 
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      ops++;
-      int x1 = x - dx - 1;
-      int x2 = x + dx;
-      int y1 = y - dy - 1;
-      int y2 = y + dy;
+/// A pyramid holds an image (level 0) and copies of it downsampled 2x,
+/// 4x, 8x, ... (levels 1, 2, 3, ...), each made from the level before by
+/// ImageDownsample.
 
-      // Ajustar os limites do retângulo para estar dentro dos limites da imagem
-      x1 = (x1 < 0) ? 0 : x1;
-      x2 = (x2 >= width) ? width - 1 : x2;
-      y1 = (y1 < 0) ? 0 : y1;
-      y2 = (y2 >= height) ? height - 1 : y2;
+// Internal structure for the pyramid of an image.
+// level[0] is the image itself, and the other levels belong to the pyramid.
+#define PYRMAX 16
 
-      // Calcular a soma dos valores dos píxeis no retângulo usando a imagem integral
-      int sum = integImg[y2 * width + x2];
+struct imagePyramid {
+  int depth;
+  Image level[PYRMAX];
+};
 
-      if (x1 > 0) 
-        sum -= integImg[y2 * width + x1 - 1];
-      
-      if (y1 > 0) 
-        sum -= integImg[(y1 - 1) * width + x2];
-      
-      if (x1 > 0 && y1 > 0) 
-        sum += integImg[(y1 - 1) * width + x1 - 1];
-      
-      // Calcular o valor médio e definir o píxel
-      // Definir o píxel na imagem desfocada para o valor médio arredondado
-      int count = (x2 - x1 + 1) * (y2 - y1 + 1);
-      uint8 meanValue = (count > 0) ? (uint8)((double)sum / count + 0.5) : 0;
+static void pyramidFree(struct imagePyramid* pyr) {
+  if (pyr == NULL) return;
+  for (int k = 1; k < pyr->depth; k++) ImageDestroy(&pyr->level[k]);
+  free(pyr);
+}
 
-      ImageSetPixel(img, x, y, meanValue);
+// dst[x] = mean of the 2x2 block of rows a and b at column 2x, rounded,
+// for x < n.
+static void downsampleRow(uint8* dst, const uint8* a, const uint8* b, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i low = _mm_set1_epi16(0xff);
+  const __m128i two = _mm_set1_epi16(2);
+  for (; x + 16 <= n; x += 16) {
+    __m128i s[2];
+    for (int k = 0; k < 2; k++) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + 2 * x + 16 * k));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + 2 * x + 16 * k));
+      // Even and odd columns, as 16-bit lanes
+      __m128i even = _mm_add_epi16(_mm_and_si128(va, low), _mm_and_si128(vb, low));
+      __m128i odd = _mm_add_epi16(_mm_srli_epi16(va, 8), _mm_srli_epi16(vb, 8));
+      s[k] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(even, odd), two), 2);
     }
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(s[0], s[1]));
+  }
+#endif
+  for (; x < n; x++) {
+    dst[x] = (uint8)((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+  }
+}
+
+/// Downsample an image 2x.
+/// Each pixel of the new image is the mean of a 2x2 block of img, rounded
+/// as (a+b+c+d+2)/4; the last column or row of img is dropped if the width
+/// or height is odd.
+/// The new image has the same maxval, and half the width and height
+/// (rounded down).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDownsample(Image img) { ///
+  assert (img != NULL);
+  int width = img->width / 2;
+  int height = img->height / 2;
+  Image small = allocImage(width, height, img->maxval);
+  if (!check( small != NULL, "Failed to allocate memory in ImageDownsample" )) {
+    return NULL;
   }
+  for (int y = 0; y < height; y++) {
+    const uint8* a = img->pixel + (size_t)(2 * y) * img->stride;
+    downsampleRow(small->pixel + (size_t)y * small->stride, a, a + img->stride, width);
+  }
+  PIXMEM += 5ul * width * height;  // count pixel memory accesses
+  return small;
+}
 
-  printf("Pior caso para o número total de operações BlurOptimized: %d\n", 3*(width * height));
+/// Get the pyramid of img, with at least depth levels (level 0 being img),
+/// or as many as possible (until the width or height would be 0).
+/// The levels are computed when first needed and kept with img until its
+/// pixels are modified, so later calls are O(1).
+/// Requires: 1 <= depth <= 16.
+/// The returned object (and its level images) belong to img: they must not
+/// be modified, and not be used after img is modified or destroyed.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePyramid ImagePyramidGet(Image img, int depth) { ///
+  assert (img != NULL);
+  assert (1 <= depth && depth <= PYRMAX);
+  ImagePyramid pyr = img->pyramid;
+  if (pyr == NULL) {
+    pyr = calloc(1, sizeof(struct imagePyramid));
+    if (!check( pyr != NULL, "Failed to allocate memory in ImagePyramidGet" )) {
+      return NULL;
+    }
+    pyr->depth = 1;
+    pyr->level[0] = img;
+    img->pyramid = pyr;
+  }
+  while (pyr->depth < depth) {
+    Image top = pyr->level[pyr->depth - 1];
+    if (top->width < 2 || top->height < 2) break;
+    Image next = ImageDownsample(top);
+    if (next == NULL) return NULL;  // errCause set by ImageDownsample
+    pyr->level[pyr->depth++] = next;
+  }
+  return pyr;
+}
 
-  // Liberar a memória alocada para a imagem integral
-  free(integImg);
+/// Number of levels of pyramid pyr.
+int ImagePyramidDepth(ImagePyramid pyr) { ///
+  assert (pyr != NULL);
+  return pyr->depth;
 }
 
-// Função auxiliar para ImageBlurOptimized
-void CreateIntegralImage(Image img, int** integImg) {
-  int width = img->width;
-  int height = img->height;
+/// Level k of pyramid pyr (the image itself for k = 0).
+/// Requires: 0 <= k < ImagePyramidDepth(pyr).
+Image ImagePyramidLevel(ImagePyramid pyr, int k) { ///
+  assert (pyr != NULL);
+  assert (0 <= k && k < pyr->depth);
+  return pyr->level[k];
+}
 
-  // Alocar memória para a imagem integral
-  *integImg = (int*)malloc(width * height * sizeof(int));
+// Coarse-to-fine exact search.
+// If img2 is at (X, Y) in img1, with s = 2^k, its complete s x s blocks
+// aligned with those of img1 start at offset (ox, oy) = (-X mod s,
+// -Y mod s) in img2, and their means are pixels of level k of the pyramid
+// of img1, because the means are computed in the same order.  So the
+// (cw x ch) top left part of level k of the crop of img2 at (ox, oy), its
+// "phase template", appears at ((X+ox)/s, (Y+oy)/s) in level k of img1.
+// cw and ch are the number of blocks that fit for every phase.
+// A single pass of the rolling hash over level k of img1 looks up the
+// hash of each window in a table of the s^2 phase templates, and each hit
+// is checked exactly at full resolution.
+
+// Smallest phase templates worth it (fewer pixels give many false hits).
+#define PYRMINSIDE 4
+
+// Entry of the hash table of phase templates.
+struct pyrPhase {
+  uint64_t hash;
+  int phase;    // oy*s + ox, or -1 for an empty slot
+};
 
-  if (*integImg == NULL) {
-    // Falha na alocação de memória
-    errCause = "Falha na alocação de memória para a imagem integral em ComputeIntegralImage";
-    return;
+// Phase template of img2 for offset (ox, oy), at level k (s = 2^k), cropped
+// to cw x ch.  Returns NULL if memory is short.
+static Image pyrPhaseTemplate(Image img2, int ox, int oy, int k, int cw, int ch) {
+  int s = 1 << k;
+  Image t = ImageView(img2, ox, oy, cw * s, ch * s);
+  for (int j = 0; t != NULL && j < k; j++) {
+    Image next = ImageDownsample(t);
+    ImageDestroy(&t);
+    t = next;
   }
+  return t;
+}
 
-  // Inicializar a primeira linha da imagem integral
-  (*integImg)[0] = ImageGetPixel(img, 0, 0);
-
-  // Calcular a primeira linha
-  for (int x = 1; x < width; ++x) {
-    (*integImg)[x] = (*integImg)[x - 1] + ImageGetPixel(img, x, 0);
+/// Locate a subimage inside another image, coarse to fine.
+/// Like ImageLocateSubImage (same results), but most of the search is done
+/// on a downsampled level of the pyramid of img1, which is kept with img1
+/// (see ImagePyramidGet), so repeated searches in the same image are
+/// faster.  Candidates are checked exactly at full resolution.
+/// Small templates, for which that does not pay off, are searched with
+/// ImageLocateSubImage.
+/// If memory is short, returns -1 (then errCause is set).
+int ImageLocatePyramid(Image img1, int* px, int* py, Image img2) { ///
+  assert (img1 != NULL && img2 != NULL);
+  int w = img2->width;
+  int h = img2->height;
+  if (w > img1->width || h > img1->height || w == 0 || h == 0) return 0;
+
+  // Deepest level with phase templates of PYRMINSIDE or more pixels a
+  // side, and building them (s^2 of them, about w*h each) a small part of
+  // the work
+  int k = 0;
+  int cw = 0, ch = 0;
+  for (int j = PYRMAX - 1; j > 0 && k == 0; j--) {
+    int s = 1 << j;
+    cw = (w - (s - 1)) / s;
+    ch = (h - (s - 1)) / s;
+    if (cw >= PYRMINSIDE && ch >= PYRMINSIDE &&
+        (double)s * s * w * h <= (double)img1->width * img1->height / 4) {
+      k = j;
+    }
+  }
+  if (k == 0) return ImageLocateSubImage(img1, px, py, img2);
+  int s = 1 << k;
+
+  ImagePyramid pyr = ImagePyramidGet(img1, k + 1);
+  if (pyr == NULL) return -1;
+  if (pyr->depth <= k) return ImageLocateSubImage(img1, px, py, img2);
+  Image coarse = ImagePyramidLevel(pyr, k);
+
+  // Hash table of the phase templates (at most half full)
+  int nphases = s * s;
+  int size = 1;
+  while (size < 2 * nphases) size *= 2;
+  int n = coarse->width - cw + 1;
+  struct pyrPhase* table = malloc((size_t)size * sizeof(struct pyrPhase));
+  uint64_t* hashes = malloc(3 * (size_t)(n > cw ? n : cw) * sizeof(uint64_t));
+  int ok = check( table != NULL && hashes != NULL, "Failed to allocate memory in ImageLocatePyramid" );
+  for (int i = 0; ok && i < size; i++) table[i].phase = -1;
+  for (int p = 0; ok && p < nphases; p++) {
+    Image t = pyrPhaseTemplate(img2, p % s, p / s, k, cw, ch);
+    if (t == NULL) {
+      ok = 0;
+      break;
+    }
+    uint64_t hv = templateHash(t, hashes);
+    ImageDestroy(&t);
+    int i = (int)(hv >> 32) & (size - 1);
+    while (table[i].phase >= 0) i = (i + 1) & (size - 1);
+    table[i] = (struct pyrPhase){hv, p};
+  }
+  if (!ok) {
+    free(table);
+    free(hashes);
+    return -1;
   }
 
-  // Calcular as linhas restantes
-  for (int y = 1; y < height; ++y) {
-    int rowSum = 0;
-    for (int x = 0; x < width; ++x) {
-      rowSum += ImageGetPixel(img, x, y);
-      (*integImg)[y * width + x] = (*integImg)[(y - 1) * width + x] + rowSum;
+  // Rolling hash over the coarse level, as in locateScan
+  uint64_t* in = hashes;
+  uint64_t* out = in + n;
+  uint64_t* col = out + n;
+  uint64_t rowTop = hashPower(ROWBASE, cw);
+  uint64_t colTop = hashPower(COLBASE, ch);
+  size_t stride = (size_t)coarse->stride;
+  memset(col, 0, (size_t)n * sizeof(uint64_t));
+  for (int j = 0; j < ch; j++) {
+    rowHashes(coarse->pixel + (size_t)j * stride, coarse->width, cw, rowTop, in);
+    for (int x = 0; x < n; x++) col[x] = col[x] * COLBASE + in[x];
+  }
+  uint64_t pixels = (uint64_t)coarse->width * ch;
+  uint64_t compared = 0;
+  int found = 0;
+  ImagePos match = {0, 0};
+  for (int cy = 0; cy + ch <= coarse->height; cy++) {
+    for (int cx = 0; cx < n; cx++) {
+      for (int i = (int)(col[cx] >> 32) & (size - 1); table[i].phase >= 0; i = (i + 1) & (size - 1)) {
+        if (table[i].hash != col[cx]) continue;
+        int x = cx * s - table[i].phase % s;
+        int y = cy * s - table[i].phase / s;
+        if (x < 0 || y < 0 || x + w > img1->width || y + h > img1->height) continue;
+        if (found && (y > match.y || (y == match.y && x > match.x))) continue;
+        compared += (uint64_t)w * h;
+        if (subImageEqual(img1, x, y, img2)) {
+          match = (ImagePos){x, y};
+          found = 1;
+        }
+      }
     }
+    // Matches found from later coarse rows have a larger y
+    if (found || cy + ch == coarse->height) break;
+    rowHashes(coarse->pixel + cy * stride, coarse->width, cw, rowTop, out);
+    rowHashes(coarse->pixel + (cy + ch) * stride, coarse->width, cw, rowTop, in);
+    for (int x = 0; x < n; x++) col[x] = col[x] * COLBASE - out[x] * colTop + in[x];
+    pixels += 2ul * coarse->width;
   }
+  free(table);
+  free(hashes);
+  PIXMEM += pixels + compared;  // count pixel memory accesses
+  PIXCMP += compared;
+
+  if (!found) return 0;
+  *px = match.x;
+  *py = match.y;
+  return 1;
 }
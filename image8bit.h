@@ -23,6 +23,44 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Types for reading and writing PGM files by bands of rows
+typedef struct imageReader *ImageReader;
+typedef struct imageWriter *ImageWriter;
+
+// Type for streaming mean filters
+typedef struct blurFilter *ImageBlurFilter;
+
+// Type for summed-area tables (integral images)
+typedef struct imageIntegral *ImageIntegral;
+
+// Type for image pyramids (downsampled copies)
+typedef struct imagePyramid *ImagePyramid;
+
+// Position of a pixel (see ImageLocateAll)
+typedef struct imagePos {
+  int x, y;
+} ImagePos;
+
+// Metrics for template matching (see ImageMatchScore)
+typedef enum { IMAGE_SAD, IMAGE_SSD, IMAGE_NCC } ImageMetric;
+
+// Histogram and stats of gray levels (see ImageHistogram)
+typedef struct imageHist {
+  uint64_t count[256];    // number of pixels with each level
+  uint64_t n;             // number of pixels
+  uint8 min, max;         // range of levels
+  uint64_t sum, sumsq;    // sum of levels and of squared levels
+} ImageHist;
+
+// Layer for ImageComposite: image img placed at (x, y), with the given
+// alpha, and an optional mask of per-pixel alpha scales (or NULL)
+typedef struct imageLayer {
+  Image img;
+  int x, y;
+  double alpha;
+  Image mask;
+} ImageLayer;
+
 /// Error handling functions
 
 /// Error cause.
@@ -51,6 +89,16 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new image with undefined pixel levels.
+/// Like ImageCreate, but the pixels are not initialized, which saves a
+/// pass over the memory when the caller is going to set every pixel anyway.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateUninit(int width, int height, uint8 maxval) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,6 +106,13 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Release all the memory kept in the image pool.
+/// Destroyed images leave their memory in a pool, to be reused by the next
+/// images created.  This gives that memory back to the system.
+/// Images that still exist are not affected.
+/// Should never fail, and should preserve global errno/errCause.
+void ImagePoolFlush(void) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,12 +122,114 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Like ImageLoad, but the pixels are not copied: the image refers directly
+/// to a private (copy-on-write) mapping of the file, so pages are only read
+/// when first accessed.  In-place operations are allowed and never change
+/// the file.  ImageDestroy releases the mapping.
+/// Files that cannot be mapped (pipes, devices) are read with ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
+/// Load many raw PGM files concurrently.
+///   names : array of n file names.
+///   out : array of n images, where the loaded images are stored.
+///   causes, errnums : optional arrays of n elements (may be NULL).
+/// Files are loaded by a pool of threads, one per available processor.
+/// If file names[i] is loaded, out[i] is the new image, causes[i] is NULL
+/// and errnums[i] is 0.  Otherwise, out[i] is NULL, causes[i] describes the
+/// failure cause and errnums[i] holds the corresponding errno value.
+/// Returns the number of images loaded.
+/// (The caller is responsible for destroying the returned images!)
+/// The global errno/errCause are preserved.
+int ImageLoadMany(const char** names, int n, Image* out,
+                  const char** causes, int* errnums) ;
+
 /// Save image to PGM file.
+/// The file is written under a temporary name in the same directory and
+/// then atomically renamed, so other processes only ever see either the
+/// previous file or the complete new one.
+/// Symbolic links are followed, and an existing file keeps its permissions.
+/// An unmodified image loaded from a file that has not changed since is
+/// copied directly from that file, without going through memory.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// the file is left as it was.
 int ImageSave(Image img, const char* filename) ;
 
+/// Save image to PGM file and make sure it reaches the disk.
+/// Like ImageSave, but the data and the new directory entry are flushed
+/// to disk (fdatasync/fsync) before returning, so that the file survives
+/// a system crash.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left as it was.
+int ImageSaveSync(Image img, const char* filename) ;
+
+/// Streaming PGM operations
+
+/// These functions read and write PGM files a band of rows at a time,
+/// so that images larger than the available memory can be processed.
+/// A band is an ordinary image with the width of the file: the pixel
+/// transformations (ImageNegative, ImageThreshold, ImageBrighten) may be
+/// applied to each band as it goes by, and ImageBlurFilter provides a
+/// streaming version of ImageBlur.
+
+/// Open a raw PGM file for reading by bands of rows.
+/// Only the header is read.
+/// On success, a new reader is returned.
+/// (The caller is responsible for closing the returned reader!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderOpen(const char* filename) ;
+
+/// Get the width of the image being read.
+int ImageReaderWidth(ImageReader r) ;
+
+/// Get the height of the image being read.
+int ImageReaderHeight(ImageReader r) ;
+
+/// Get the maximum gray level of the image being read.
+int ImageReaderMaxval(ImageReader r) ;
+
+/// Read the next band of rows.
+/// Fills the top rows of band with as many of the remaining rows as fit.
+/// Requires: band has the same width as the image being read.
+/// Returns the number of rows read: less than the band height only for the
+/// last band, and 0 once all rows have been read.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageReadBand(ImageReader r, Image band) ;
+
+/// Close a reader and set (*rp) to NULL.
+/// If (*rp)==NULL, no operation is performed.
+void ImageReaderClose(ImageReader* rp) ;
+
+/// Create a raw PGM file for writing by bands of rows.
+/// The file is written under a temporary name in the same directory and
+/// only replaces filename when the writer is closed after all rows.
+/// Symbolic links are followed, and an existing file keeps its permissions.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new writer is returned.
+/// (The caller is responsible for closing the returned writer!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterOpen(const char* filename, int width, int height, uint8 maxval) ;
+
+/// Append the top rows of band to the file.
+/// Requires: band has the same width as the image being written,
+/// 0 <= rows <= band height, and no more rows than the remaining ones.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageWriteBand(ImageWriter w, Image band, int rows) ;
+
+/// Close a writer and set (*wp) to NULL.
+/// If (*wp)==NULL, no operation is performed and nonzero is returned.
+/// Returns nonzero if all rows were written and the file was closed
+/// successfully.
+/// Otherwise, returns 0, errno/errCause are set appropriately, the
+/// partial file is removed and filename is left as it was.
+int ImageWriterClose(ImageWriter* wp) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -91,8 +248,31 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// (Both are 0 for an empty image.)
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Histogram and stats
+/// Compute the histogram of gray levels of img into *hist, along with the
+/// number of pixels, minimum, maximum, sum and sum of squares of levels.
+/// The pixels are counted in one pass, into 4 interleaved sub-histograms,
+/// so that repeated levels do not stall on the same counter.
+/// For an empty image, all fields are 0.
+void ImageHistogram(Image img, ImageHist* hist) ;
+
+/// Mean gray level of a histogram (0 if empty).
+double ImageHistMean(const ImageHist* hist) ;
+
+/// Standard deviation of the gray levels of a histogram (0 if empty).
+/// (Population standard deviation: the sum of squared deviations from
+/// the mean is divided by the number of pixels.)
+double ImageHistStddev(const ImageHist* hist) ;
+
+/// Percentile p (in [0, 100]) of the gray levels of a histogram.
+/// Returns the lowest level such that at least p% of the pixels are at or
+/// below it (so p = 0 gives the minimum, p = 50 the median, p = 100 the
+/// maximum), or 0 if the histogram is empty.
+int ImageHistPercentile(const ImageHist* hist, double p) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -116,8 +296,11 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// except that an image sharing its pixels (see ImageView) first gets a
+/// private copy of them.
+/// They never fail, unless that copy cannot be allocated: then the image is
+/// left unchanged and errCause is set.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
@@ -135,6 +318,35 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Point operations as lookup tables.
+
+/// Any transformation of each pixel level that does not depend on the
+/// position of the pixel is described by a lookup table (LUT) with
+/// PixMax+1 entries: level v becomes lut[v].
+/// The ImageLUT* functions below apply a transformation to the entries of
+/// a LUT, so that calling several of them in sequence on the same LUT
+/// (starting from ImageLUTIdentity) builds the composition of the
+/// transformations, in that order, to be applied in a single pass by
+/// ImageApplyLUT.  User-supplied curves may be built directly.
+
+/// Set lut to the identity transformation.
+void ImageLUTIdentity(uint8 lut[256]) ;
+
+/// Compose lut with the negative transformation (see ImageNegative).
+void ImageLUTNegative(uint8 lut[256], uint8 maxval) ;
+
+/// Compose lut with the threshold transformation (see ImageThreshold).
+void ImageLUTThreshold(uint8 lut[256], uint8 maxval, uint8 thr) ;
+
+/// Compose lut with the brighten transformation (see ImageBrighten).
+/// Levels are rounded to the nearest integer and saturated at maxval.
+/// Negative factors are taken as 0.
+void ImageLUTBrighten(uint8 lut[256], uint8 maxval, double factor) ;
+
+/// Transform each pixel level v of img to lut[v].
+/// Like the other pixel transformations, this modifies img in-place.
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +367,24 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image by 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Rotate an image by 90 degrees clockwise (270 anti-clockwise).
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -178,6 +408,23 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Create a view of a rectangular subimage of img.
+/// The rectangle is specified as in ImageCrop.
+/// The view shares the pixels of img: no pixels are copied.
+/// Modifying either the view or img in place gives the modified image
+/// a private copy of its pixels first (copy-on-write), so the result
+/// always behaves as an independent copy, like the result of ImageCrop.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -191,26 +438,294 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
-/// may provide interesting effects.  Over/underflows should saturate.
+/// may provide interesting effects.  Over/underflows saturate to
+/// [0, maxval] of img1.
+/// Each pixel becomes round((1-alpha)*pixel1 + alpha*pixel2), computed in
+/// fixed point, a row at a time.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Composite several layers into an image.
+/// Layers are applied in order, layers[0] at the bottom and layers[n-1] on
+/// top.  Each layer places its image img with the top left corner at
+/// (x, y) of dst; only the part inside dst is used.
+/// A layer with alpha 1.0 and no mask is pasted, like ImagePaste;
+/// otherwise it is blended, like ImageBlend, with the given alpha.
+/// If mask is not NULL, it must have the size of img, and the alpha of
+/// each pixel is scaled by mask level / mask maxval.
+/// The result is the same as pasting or blending each layer in turn, but
+/// dst is built in a single pass over its rows, visiting only the layers
+/// that cover each row, and skipping the parts of layers that are
+/// covered by pasted layers above them.
+/// Requires: no layer image or mask is dst itself.
+/// This modifies dst in-place.
+/// If the working memory cannot be allocated, dst is left unchanged and
+/// errCause is set.
+void ImageComposite(Image dst, const ImageLayer* layers, int n) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
+/// A few probes are checked first (the first pixel, the center pixel, and
+/// the last row), so most mismatches are rejected without comparing the
+/// whole window.  Then the rows are compared whole.
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// When several positions match, the first in row-major order (lowest y,
+/// then lowest x) is returned.
+/// This uses a 2D rolling hash: the expected cost is O(W*H), whatever the
+/// size of img2, with working memory for a few rows of hashes.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate all the occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and stores the positions of the matches
+/// in row-major order in the array *pos of *cap positions.
+/// *pos must be NULL (with *cap = 0) or point to memory allocated with
+/// malloc; it is grown with realloc as needed, updating *pos and *cap.
+/// (The caller is responsible for freeing *pos!)
+/// At most max matches are stored (the first ones), or all of them if
+/// max <= 0.
+/// The rows of img1 are split across threads, one per available processor.
+/// If cancel is not NULL, the search stops as soon as possible once *cancel
+/// becomes nonzero (for instance, set from another thread).
+/// Returns the number of matches stored, or -1 if the search was
+/// cancelled or memory was short (then errCause is set).
+int ImageLocateAll(Image img1, Image img2, ImagePos** pos, int* cap, int max,
+                   const volatile int* cancel) ;
+
+/// Locate several subimages inside an image.
+/// Searches for each of the n images tmpl[0..n) inside img, and sets
+/// results[i] to the first position in row-major order where tmpl[i]
+/// matches (as ImageLocateSubImage would), or to (-1, -1) if it does not.
+/// The templates are hashed into a single table and img is scanned only
+/// once, so the cost is O(W*H) per distinct template width, plus the
+/// hashing of the templates, rather than per template.
+/// Returns the number of templates found, or -1 if memory was short
+/// (then errCause is set).
+int ImageLocateMany(Image img, Image* tmpl, int n, ImagePos* results) ;
+
+/// Template matching scores.
+/// Compare tmpl with the window of img at each position (x, y) where tmpl
+/// fits, with one of these metrics:
+///   IMAGE_SAD: sum of absolute differences (0 for a perfect match);
+///   IMAGE_SSD: sum of squared differences (0 for a perfect match);
+///   IMAGE_NCC: normalized cross-correlation, in [-1, 1] (1 for a perfect
+///     match up to brightness and contrast, 0 if the window or tmpl is flat).
+/// SAD is computed directly with SIMD; SSD and NCC use running box sums,
+/// and FFTs for templates larger than a few hundred pixels.
+/// Requires: tmpl is not empty and fits in img.
+///
+/// On success, returns a new map of (W-w+1)*(H-h+1) scores, row by row:
+/// the score of position (x, y) is at index y*(W-w+1) + x.
+/// SAD and SSD scores are exact (doubles hold integers up to 2^53).
+/// (The caller is responsible for freeing the returned map!)
+/// On failure, returns NULL and errCause is set.
+double* ImageMatchScore(Image img, Image tmpl, ImageMetric metric) ;
+
+/// Best template matches.
+/// Find the k positions of img where tmpl matches best with metric (see
+/// ImageMatchScore), and store them, best first, in pos[0..k), with their
+/// scores in score[0..k) (if score is not NULL).
+/// Ties are resolved in favor of the first position in row-major order.
+/// Only a band of scores is kept in memory at a time.
+/// Requires: tmpl is not empty and fits in img; k >= 0.
+/// Returns the number of matches stored (k, or fewer if there are fewer
+/// positions), or -1 if memory is short (then errCause is set).
+int ImageMatchBest(Image img, Image tmpl, ImageMetric metric, int k,
+                   ImagePos* pos, double* score) ;
+
+/// Locate a template in an image with tolerance.
+/// Searches for the first position of img, in row-major order, where the
+/// score of tmpl with metric (see ImageMatchScore) is within threshold:
+/// at most threshold for IMAGE_SAD and IMAGE_SSD, at least threshold for
+/// IMAGE_NCC.
+/// Requires: tmpl is not empty and fits in img.
+/// If a match is found, returns 1 and its position is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Returns -1 if memory is short (then errCause is set).
+int ImageLocateApprox(Image img, int* px, int* py, Image tmpl,
+                      ImageMetric metric, double threshold) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// The cost per pixel does not depend on dx and dy.
+/// If the working memory (about 2dy+1 rows) cannot be allocated,
+/// the image is left unchanged and errCause is set.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Create a filter that blurs a (width x height) image streamed in bands,
+/// with the same (2dx+1)x(2dy+1) mean filter as ImageBlur.
+/// Only 2dy+1 input rows are kept by the filter.
+/// Requires: width and height must be non-negative, dx, dy >= 0.
+/// On success, a new filter is returned.
+/// (The caller is responsible for destroying the returned filter!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageBlurFilter ImageBlurFilterCreate(int width, int height, int dx, int dy) ;
+
+/// Feed the next rows of the input image to the filter.
+/// The top rows rows of band are consumed, and the output rows that became
+/// complete are written to the top rows of out.
+/// Output lags input by dy rows, and the remaining rows are produced when
+/// the last input row is received.
+/// Requires: band and out have the filter width, 0 <= rows <= band height,
+/// no more rows than the remaining ones, and out has at least rows+dy rows.
+/// Returns the number of rows written to out.
+/// On failure (out is shared and cannot be copied), returns -1 and
+/// errCause is set.
+int ImageBlurFilterPush(ImageBlurFilter bf, Image band, int rows, Image out) ;
+
+/// Destroy the filter pointed to by (*bfp).
+/// If (*bfp)==NULL, no operation is performed.
+/// Ensures: (*bfp)==NULL.
+void ImageBlurFilterDestroy(ImageBlurFilter* bfp) ;
+
+/// Convolve an image with a kernel.
+/// kernel holds kh rows of kw weights: each pixel (x, y) becomes the sum
+/// of kernel[j*kw+i] times pixel (x+i-kw/2, y+j-kh/2), for all i, j,
+/// rounded to the nearest integer and saturated to [0, maxval].
+/// Like in ImageBlur, only the pixels inside the image are used: when the
+/// kernel weights do not add up to 0, results near the borders are
+/// rescaled by the total weight over the weight of the pixels used.
+/// Kernels of rank 1 (like the Gaussian) are detected and applied as a
+/// horizontal and a vertical pass.
+/// Weights are applied in fixed point, with about 4 significant digits.
+/// Requires: kw and kh odd and positive, weights at most 32767 in
+/// absolute value, adding up to at most 4210752 in absolute value.
+/// The image is changed in-place.
+/// If the working memory cannot be allocated, the image is left unchanged
+/// and errCause is set.
+void ImageConvolve(Image img, const double* kernel, int kw, int kh) ;
+
+/// Blur an image with a Gaussian filter of standard deviation sigma.
+/// The filter is approximated by three extended box filters, so the cost
+/// per pixel does not depend on sigma.
+/// Like in ImageBlur, only the pixels inside the image are used near the
+/// borders.
+/// Large images are processed by a pool of threads, one per available
+/// processor.
+/// Requires: sigma >= 0.
+/// The image is changed in-place.
+/// If the working memory (a few rows or columns of floats) cannot be
+/// allocated, the image is left unchanged and errCause is set.
+void ImageGaussianBlur(Image img, double sigma) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (only the pixels inside the image, like in
+/// ImageBlur).  When that rectangle has an even number of pixels, the
+/// lower of the two middle levels is taken.
+/// The cost per pixel does not depend on dx and dy.
+/// Requires: dx >= 0, 0 <= dy < 32768.
+/// The image is changed in-place.
+/// If the working memory (a histogram per column and about dy rows) cannot
+/// be allocated, the image is left unchanged and errCause is set.
+void ImageMedian(Image img, int dx, int dy) ;
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (only the pixels inside the image, like in
+/// ImageBlur).
+/// The cost per pixel does not depend on dx and dy.
+/// Binary images (with all levels 0 or maxval, like the results of
+/// ImageThreshold) are processed 64 pixels at a time.
+/// Requires: dx, dy >= 0.
+/// The image is changed in-place.
+/// If the working memory (a few rows or columns) cannot be allocated,
+/// the image is left unchanged and errCause is set.
+void ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], with the same conventions as ImageErode.
+void ImageDilate(Image img, int dx, int dy) ;
+
+/// Open an image with a (2dx+1)x(2dy+1) rectangle.
+/// This is an erosion followed by a dilation: it removes bright details
+/// smaller than the rectangle.  Same conventions as ImageErode.
+void ImageOpen(Image img, int dx, int dy) ;
+
+/// Close an image with a (2dx+1)x(2dy+1) rectangle.
+/// This is a dilation followed by an erosion: it fills dark details
+/// smaller than the rectangle.  Same conventions as ImageErode.
+void ImageClose(Image img, int dx, int dy) ;
+
+/// Summed-area tables
+
+/// These allow computing statistics of any rectangle of an image in O(1),
+/// after a single pass over the image.
+
+/// Get the summed-area tables of img.
+/// The tables are computed on the first call and kept with img until its
+/// pixels are modified, so later calls are O(1).
+/// The returned object belongs to img: it must not be used after img is
+/// modified or destroyed.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIntegral ImageIntegralGet(Image img) ;
+
+/// Sum of the pixel levels in the rectangle (x, y, w, h).
+/// Requires: the rectangle must be inside the image of ii.
+uint64_t ImageRectSum(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Mean of the pixel levels in the rectangle (x, y, w, h).
+/// Requires: the rectangle must be inside the image of ii and not empty.
+double ImageRectMean(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Variance of the pixel levels in the rectangle (x, y, w, h).
+/// This is the population variance: the mean of the squared deviations.
+/// Requires: the rectangle must be inside the image of ii and not empty.
+double ImageRectVariance(ImageIntegral ii, int x, int y, int w, int h) ;
+
+
+/// Image pyramids
+
+/// A pyramid holds an image (level 0) and copies of it downsampled 2x,
+/// 4x, 8x, ... (levels 1, 2, 3, ...), each made from the level before by
+/// ImageDownsample.
+
+/// Downsample an image 2x.
+/// Each pixel of the new image is the mean of a 2x2 block of img, rounded
+/// as (a+b+c+d+2)/4; the last column or row of img is dropped if the width
+/// or height is odd.
+/// The new image has the same maxval, and half the width and height
+/// (rounded down).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDownsample(Image img) ;
+
+/// Get the pyramid of img, with at least depth levels (level 0 being img),
+/// or as many as possible (until the width or height would be 0).
+/// The levels are computed when first needed and kept with img until its
+/// pixels are modified, so later calls are O(1).
+/// Requires: 1 <= depth <= 16.
+/// The returned object (and its level images) belong to img: they must not
+/// be modified, and not be used after img is modified or destroyed.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePyramid ImagePyramidGet(Image img, int depth) ;
+
+/// Number of levels of pyramid pyr.
+int ImagePyramidDepth(ImagePyramid pyr) ;
+
+/// Level k of pyramid pyr (the image itself for k = 0).
+/// Requires: 0 <= k < ImagePyramidDepth(pyr).
+Image ImagePyramidLevel(ImagePyramid pyr, int k) ;
+
+/// Locate a subimage inside another image, coarse to fine.
+/// Like ImageLocateSubImage (same results), but most of the search is done
+/// on a downsampled level of the pyramid of img1, which is kept with img1
+/// (see ImagePyramidGet), so repeated searches in the same image are
+/// faster.  Candidates are checked exactly at full resolution.
+/// Small templates, for which that does not pay off, are searched with
+/// ImageLocateSubImage.
+/// If memory is short, returns -1 (then errCause is set).
+int ImageLocatePyramid(Image img1, int* px, int* py, Image img2) ;
+
 #endif
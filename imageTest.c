@@ -15,13 +15,929 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include "image8bit.h"
 #include "instrumentation.h"
 
+// Self checks (imageTest check)
+//
+// The faster module functions are compared with simple reference
+// implementations, pixel by pixel, on random images of many sizes.
+// Each check returns the number of mismatches found.
+
+// Create a w x h image of random levels in [0, levels).
+static Image randomImage(int w, int h, int levels, uint8 maxval) {
+  Image img = ImageCreate(w, h, maxval);
+  if (img == NULL) {
+    error(2, errno, "Creating image: %s", ImageErrMsg());
+  }
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(img, x, y, (uint8)(rand() % levels));
+    }
+  }
+  return img;
+}
+
+// Do img1 and img2 have the same size and pixels?
+static int sameImage(Image img1, Image img2) {
+  if (ImageWidth(img1) != ImageWidth(img2) || ImageHeight(img1) != ImageHeight(img2)) {
+    return 0;
+  }
+  return ImageMatchSubImage(img1, 0, 0, img2);
+}
+
+// Do the pixels of img equal levels (w x h, row by row)?
+static int sameLevels(Image img, const uint8* levels) {
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      if (ImageGetPixel(img, x, y) != levels[y * ImageWidth(img) + x]) return 0;
+    }
+  }
+  return 1;
+}
+
+// Copy the pixels of img into levels (w x h, row by row).
+static void saveLevels(Image img, uint8* levels) {
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      levels[y * ImageWidth(img) + x] = ImageGetPixel(img, x, y);
+    }
+  }
+}
+
+// Copy-on-write views (ImageView): writing to a view must not change the
+// image it was taken from, nor the other way around, also for views of
+// views and after the parent is destroyed.
+static int checkViews(void) {
+  static uint8 parent[50*40], view[20*15], inner[8*6];
+  int bad = 0;
+  for (int t = 0; t < 4; t++) {
+    Image img = randomImage(50, 40, 256, 255);
+    Image v1 = ImageView(img, 5, 7, 20, 15);
+    Image v2 = ImageView(v1, 3, 2, 8, 6);
+    saveLevels(img, parent);
+    saveLevels(v1, view);
+    saveLevels(v2, inner);
+    bad += ImageGetPixel(v1, 0, 0) != ImageGetPixel(img, 5, 7);
+    bad += ImageGetPixel(v2, 0, 0) != ImageGetPixel(img, 8, 9);
+    switch (t) {
+    case 0:  // write to the view
+      ImageNegative(v1);
+      bad += !sameLevels(img, parent) || !sameLevels(v2, inner);
+      bad += ImageGetPixel(v1, 4, 3) != 255 - view[3*20 + 4];
+      break;
+    case 1:  // write to the parent
+      ImageNegative(img);
+      bad += !sameLevels(v1, view) || !sameLevels(v2, inner);
+      bad += ImageGetPixel(img, 9, 8) != 255 - parent[8*50 + 9];
+      break;
+    case 2:  // write to the view of a view
+      ImageSetPixel(v2, 1, 1, ~inner[1*8 + 1]);
+      bad += !sameLevels(img, parent) || !sameLevels(v1, view);
+      bad += ImageGetPixel(v2, 1, 1) != (uint8)~inner[1*8 + 1];
+      break;
+    case 3:  // destroy the parent first
+      ImageDestroy(&img);
+      ImageSetPixel(v1, 0, 0, ~view[0]);
+      bad += !sameLevels(v2, inner);
+      break;
+    }
+    ImageDestroy(&v2);
+    ImageDestroy(&v1);
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// ImageLoadMany on a mix of files: saved images (one named twice), a
+// missing file, a file that is not a PGM and a pipe.  Each result must
+// match what ImageLoad gives for the same name, including the cause.
+static int checkLoadMany(void) {
+  enum { NFILES = 4, N = NFILES + 4 };
+  char dir[] = "/tmp/imageTestXXXXXX";
+  char paths[N][64];
+  const char* names[N];
+  Image imgs[NFILES], out[N];
+  const char* causes[N];
+  int errnums[N];
+  int fds[2];
+  int bad = 0;
+
+  if (mkdtemp(dir) == NULL) error(2, errno, "Creating %s", dir);
+  for (int i = 0; i < NFILES; i++) {
+    imgs[i] = randomImage(10 + 37*i, 5 + 23*i, 256 - 30*i, 255 - 30*i);
+    snprintf(paths[i], sizeof(paths[i]), "%s/img%d.pgm", dir, i);
+    if (ImageSave(imgs[i], paths[i]) == 0) {
+      error(2, errno, "Saving %s: %s", paths[i], ImageErrMsg());
+    }
+  }
+  snprintf(paths[NFILES], sizeof(paths[0]), "%s", paths[1]);
+  snprintf(paths[NFILES+1], sizeof(paths[0]), "%s/missing.pgm", dir);
+  snprintf(paths[NFILES+2], sizeof(paths[0]), "%s/invalid.pgm", dir);
+  FILE* f = fopen(paths[NFILES+2], "w");
+  if (f == NULL) error(2, errno, "Creating %s", paths[NFILES+2]);
+  fputs("P2\n3 2\n255\n1 2 3 4 5 6\n", f);
+  fclose(f);
+
+  // A small image fits in the pipe buffer, so it can be written up front
+  Image piped = randomImage(7, 3, 201, 200);
+  if (pipe(fds) != 0) error(2, errno, "Creating pipe");
+  snprintf(paths[NFILES+3], sizeof(paths[0]), "/dev/fd/%d", fds[0]);
+  f = fdopen(fds[1], "w");
+  fprintf(f, "P5\n7 3\n200\n");
+  for (int y = 0; y < 3; y++) {
+    for (int x = 0; x < 7; x++) fputc(ImageGetPixel(piped, x, y), f);
+  }
+  fclose(f);
+
+  for (int i = 0; i < N; i++) names[i] = paths[i];
+  errno = EDOM;
+  int loaded = ImageLoadMany(names, N, out, causes, errnums);
+  bad += errno != EDOM;
+  bad += loaded != NFILES + 2;
+
+  for (int i = 0; i < N; i++) {
+    if (i == NFILES+3) {
+      // The pipe was drained, so compare with what was written to it
+      bad += out[i] == NULL || causes[i] != NULL || errnums[i] != 0;
+      if (out[i] != NULL) {
+        bad += !sameImage(out[i], piped) || ImageMaxval(out[i]) != 200;
+      }
+      continue;
+    }
+    Image ref = ImageLoad(names[i]);
+    if (ref == NULL) {
+      bad += out[i] != NULL || causes[i] == NULL;
+      if (causes[i] != NULL) bad += strcmp(causes[i], ImageErrMsg()) != 0;
+    } else {
+      bad += out[i] == NULL || causes[i] != NULL || errnums[i] != 0;
+      if (out[i] != NULL) {
+        bad += !sameImage(out[i], ref) || ImageMaxval(out[i]) != ImageMaxval(ref);
+      }
+      ImageDestroy(&ref);
+    }
+  }
+  // The missing file and the invalid one must have failed (errno is only
+  // meaningful for the first: the second is a format error)
+  bad += out[NFILES+1] != NULL || errnums[NFILES+1] != ENOENT;
+  bad += out[NFILES+2] != NULL;
+  // Both loads of the same file must match the saved image
+  for (int i = 0; i < NFILES; i++) {
+    if (out[i] != NULL) bad += !sameImage(out[i], imgs[i]);
+  }
+  if (out[NFILES] != NULL) bad += !sameImage(out[NFILES], imgs[1]);
+
+  for (int i = 0; i < N; i++) {
+    if (out[i] != NULL) ImageDestroy(&out[i]);
+  }
+  for (int i = 0; i < NFILES; i++) ImageDestroy(&imgs[i]);
+  ImageDestroy(&piped);
+  close(fds[0]);
+  for (int i = 0; i < NFILES; i++) unlink(paths[i]);
+  unlink(paths[NFILES+2]);
+  rmdir(dir);
+  return bad;
+}
+
+// Are all the pixels of img at level v?
+static int allLevel(Image img, uint8 v) {
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      if (ImageGetPixel(img, x, y) != v) return 0;
+    }
+  }
+  return 1;
+}
+
+// The image pool: a destroyed image's buffer is reused by the next image
+// of the same size, and ImageCreate clears it to black even then.
+static int checkPool(void) {
+  static const int sizes[][2] = {
+    { 1, 1 }, { 0, 5 }, { 5, 0 }, { 33, 17 }, { 64, 64 }, { 65, 3 },
+    { 200, 151 }, { 641, 480 },
+  };
+  int bad = 0;
+  ImagePoolFlush();
+  for (size_t t = 0; t < sizeof(sizes) / sizeof(sizes[0]); t++) {
+    int w = sizes[t][0], h = sizes[t][1];
+    Image img = ImageCreate(w, h, 255);
+    bad += !allLevel(img, 0);
+    ImageNegative(img);
+    ImageDestroy(&img);
+    // The levels of ImageCreateUninit are undefined, but here they show
+    // that it got the buffer just released
+    img = ImageCreateUninit(w, h, 255);
+    bad += !allLevel(img, 255);
+    ImageDestroy(&img);
+    img = ImageCreate(w, h, 255);
+    bad += !allLevel(img, 0);
+    ImageDestroy(&img);
+    // A smaller image of the same size class
+    if (h > 1) {
+      img = ImageCreateUninit(w, h, 255);
+      ImageThreshold(img, 0);  // all white
+      ImageDestroy(&img);
+      img = ImageCreate(w, h - 1, 255);
+      bad += !allLevel(img, 0);
+      ImageDestroy(&img);
+    }
+  }
+  ImagePoolFlush();
+  return bad;
+}
+
+// ImageRotate, ImageRotate180, ImageRotate270 and ImageMirror against
+// moving each pixel, on sizes that are not multiples of the tiles, empty
+// images and a view (whose rows are not contiguous).
+static int checkRotate(void) {
+  static const int sizes[][2] = {
+    { 1, 1 }, { 0, 0 }, { 0, 7 }, { 7, 0 }, { 17, 33 }, { 15, 16 },
+    { 67, 130 }, { 130, 67 }, { 129, 1 }, { 1, 129 }, { 200, 201 },
+  };
+  int n = sizeof(sizes) / sizeof(sizes[0]);
+  Image big = randomImage(90, 80, 256, 255);
+  int bad = 0;
+  for (int t = 0; t <= n; t++) {
+    Image img = (t < n) ? randomImage(sizes[t][0], sizes[t][1], 256, 255)
+                        : ImageView(big, 3, 5, 67, 45);
+    int w = ImageWidth(img), h = ImageHeight(img);
+    Image r90 = ImageRotate(img);
+    Image r180 = ImageRotate180(img);
+    Image r270 = ImageRotate270(img);
+    Image mir = ImageMirror(img);
+    if (r90 == NULL || r180 == NULL || r270 == NULL || mir == NULL) {
+      error(2, errno, "Rotating image: %s", ImageErrMsg());
+    }
+    bad += ImageWidth(r90) != h || ImageHeight(r90) != w;
+    bad += ImageWidth(r270) != h || ImageHeight(r270) != w;
+    bad += ImageWidth(r180) != w || ImageHeight(r180) != h;
+    bad += ImageWidth(mir) != w || ImageHeight(mir) != h;
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        uint8 p = ImageGetPixel(img, x, y);
+        bad += ImageGetPixel(r90, y, w - 1 - x) != p;
+        bad += ImageGetPixel(r180, w - 1 - x, h - 1 - y) != p;
+        bad += ImageGetPixel(r270, h - 1 - y, x) != p;
+        bad += ImageGetPixel(mir, w - 1 - x, y) != p;
+      }
+    }
+    ImageDestroy(&mir);
+    ImageDestroy(&r270);
+    ImageDestroy(&r180);
+    ImageDestroy(&r90);
+    ImageDestroy(&img);
+  }
+  ImageDestroy(&big);
+  return bad;
+}
+
+// Order of two levels, for qsort.
+static int cmpLevels(const void* a, const void* b) {
+  return (int)*(const uint8*)a - (int)*(const uint8*)b;
+}
+
+// Compare the histogram of img and its stats with ones computed pixel by
+// pixel: percentiles from the sorted levels, stddev in two passes.
+static int histLevels(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  size_t n = (size_t)w * h;
+  uint8* sorted = malloc(n + 1);
+  if (sorted == NULL) error(2, errno, "Allocating levels");
+  uint64_t count[256] = { 0 };
+  uint64_t sum = 0, sumsq = 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 v = ImageGetPixel(img, x, y);
+      sorted[(size_t)y * w + x] = v;
+      count[v]++;
+      sum += v;
+      sumsq += (uint64_t)v * v;
+    }
+  }
+  qsort(sorted, n, 1, cmpLevels);
+  ImageHist hist;
+  ImageHistogram(img, &hist);
+  int bad = 0;
+  for (int v = 0; v < 256; v++) bad += hist.count[v] != count[v];
+  bad += hist.n != n || hist.sum != sum || hist.sumsq != sumsq;
+  bad += hist.min != (n ? sorted[0] : 0) || hist.max != (n ? sorted[n-1] : 0);
+
+  double mean = n ? (double)sum / n : 0.0;
+  double dev = 0.0;
+  for (size_t i = 0; i < n; i++) dev += (sorted[i] - mean) * (sorted[i] - mean);
+  double sd = n ? sqrt(dev / n) : 0.0;
+  bad += fabs(ImageHistMean(&hist) - mean) > 1e-9 * (1 + mean);
+  bad += fabs(ImageHistStddev(&hist) - sd) > 1e-9 * (1 + sd);
+  // Whole percentiles, and some halves and eighths, which are exact
+  for (int k = 0; k <= 100 + 8; k++) {
+    double p = (k <= 100) ? k : (k - 100) * 12.5 - 0.5 * (k & 1);
+    // Lowest level with at least p% of the pixels at or below it
+    size_t i = 0;
+    while (n > 0 && i < n - 1 && 100.0 * (i + 1) < p * n) i++;
+    bad += ImageHistPercentile(&hist, p) != (n ? sorted[i] : 0);
+  }
+  if (n > 0) {
+    bad += ImageHistPercentile(&hist, 0) != sorted[0];
+    bad += ImageHistPercentile(&hist, 100) != sorted[n-1];
+  }
+  free(sorted);
+  return bad;
+}
+
+// ImageHistogram and the stats derived from it, against counting pixel by
+// pixel: on random images (few levels, all levels, views, empty), and on
+// an image with more than HISTFLUSH (2^30) pixels, so its counts pass
+// through the 32-bit sub-histograms more than once.  That image is a
+// sparse file mapped with ImageLoadMapped, mostly black, with a few rows
+// of levels before and after the flush.
+static int checkHistogram(void) {
+  int bad = 0;
+  // Pixel counts that are multiples of 100 make p% of them a whole rank
+  static const int sizes[][2] = { { 10, 10 }, { 25, 40 }, { 100, 30 }, { 7, 100 } };
+  for (int t = 0; t < 12; t++) {
+    int levels = (t < 4) ? 1 + t : 256;
+    int w = (t < 8) ? sizes[t % 4][0] : 1 + rand() % 300;
+    int h = (t < 8) ? sizes[t % 4][1] : 1 + rand() % 200;
+    Image img = randomImage(w, h, levels, 255);
+    if (t % 3 == 2) {
+      Image view = ImageView(img, 1, 0, ImageWidth(img) - 1, ImageHeight(img));
+      ImageDestroy(&img);
+      img = view;
+    }
+    bad += histLevels(img);
+    ImageDestroy(&img);
+  }
+  Image empty = ImageCreate(0, 9, 255);
+  bad += histLevels(empty);
+  ImageDestroy(&empty);
+
+  enum { W = 1 << 15, H = (1 << 15) + 1 };
+  static const int rows[] = { 0, 1, H - 2, H - 1 };
+  char name[] = "/tmp/imageTestXXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0) error(2, errno, "Creating %s", name);
+  char header[32];
+  int len = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", W, H);
+  static uint8 row[W];
+  uint64_t count[256] = { 0 };
+  count[0] = (uint64_t)W * H;
+  int ok = write(fd, header, len) == len &&
+           ftruncate(fd, len + (off_t)W * H) == 0;
+  for (int r = 0; ok && r < 4; r++) {
+    for (int x = 0; x < W; x++) {
+      row[x] = (uint8)(rand() % 256);
+      count[row[x]]++;
+      count[0]--;
+    }
+    ok = pwrite(fd, row, W, len + (off_t)rows[r] * W) == W;
+  }
+  close(fd);
+  if (!ok) error(2, errno, "Writing %s", name);
+  Image big = ImageLoadMapped(name);
+  unlink(name);
+  if (big == NULL) error(2, errno, "Loading %s: %s", name, ImageErrMsg());
+  ImageHist hist;
+  ImageHistogram(big, &hist);
+  uint64_t sum = 0;
+  for (int v = 0; v < 256; v++) {
+    bad += hist.count[v] != count[v];
+    sum += count[v] * v;
+  }
+  bad += hist.n != (uint64_t)W * H || hist.sum != sum;
+  bad += ImageHistPercentile(&hist, 100) != hist.max;
+  ImageDestroy(&big);
+  return bad;
+}
+
+// Reference blend of levels p1 and p2 (see ImageBlend).
+static int blendLevel(int p1, int p2, double alpha, int maxval) {
+  double v = round((1.0 - alpha) * p1 + alpha * p2);
+  return !(v > 0) ? 0 : (v >= maxval) ? maxval : (int)v;
+}
+
+// ImageBlend (in fixed point) against the blend formula, in double.
+static int checkBlend(void) {
+  double odd[] = { 1.0/3, 2.0/3, 1e-9, 1 - 1e-9, 0.99999, 1e12, -1e12, -3, 7 };
+  int bad = 0;
+  for (int k = 0; k < 129 + 9; k++) {
+    double alpha = (k < 129) ? (k - 32) / 64.0 : odd[k - 129];
+    Image img1 = ImageCreate(300, 280, 250);
+    Image img2 = ImageCreate(256, 256, 255);
+    for (int y = 0; y < 256; y++) {
+      for (int x = 0; x < 256; x++) {
+        ImageSetPixel(img1, x + 20, y + 10, (uint8)(x < 250 ? x : 250));
+        ImageSetPixel(img2, x, y, (uint8)y);
+      }
+    }
+    ImageBlend(img1, 20, 10, img2, alpha);
+    for (int y = 0; y < 256; y++) {
+      for (int x = 0; x < 256; x++) {
+        int p1 = (x < 250) ? x : 250;
+        bad += ImageGetPixel(img1, x + 20, y + 10) != blendLevel(p1, y, alpha, 250);
+      }
+    }
+    ImageDestroy(&img1);
+    ImageDestroy(&img2);
+  }
+  return bad;
+}
+
+// ImageComposite against pasting or blending the layers in turn.
+static int checkComposite(void) {
+  int bad = 0;
+  for (int t = 0; t < 200; t++) {
+    int w = 1 + rand() % 80;
+    int h = 1 + rand() % 80;
+    Image dst = randomImage(w, h, 201, 200);
+    Image ref = ImageCrop(dst, 0, 0, w, h);
+    ImageLayer layer[40];
+    int n = rand() % ((t % 10 == 0) ? 40 : 8);
+    for (int k = 0; k < n; k++) {
+      ImageLayer* l = &layer[k];
+      l->img = randomImage(1 + rand() % 60, 1 + rand() % 60, 256, 255);
+      l->x = rand() % (w + 40) - 20;
+      l->y = rand() % (h + 40) - 20;
+      int kind = rand() % 4;
+      l->alpha = (kind < 2) ? 1.0 : (rand() % 300 - 100) / 100.0;
+      l->mask = NULL;
+      if (kind == 1 && rand() % 2) {
+        l->mask = randomImage(ImageWidth(l->img), ImageHeight(l->img), 101, 100);
+      }
+      // The part of the layer inside ref
+      int x0 = (l->x > 0) ? l->x : 0;
+      int y0 = (l->y > 0) ? l->y : 0;
+      int x1 = (l->x + ImageWidth(l->img) < w) ? l->x + ImageWidth(l->img) : w;
+      int y1 = (l->y + ImageHeight(l->img) < h) ? l->y + ImageHeight(l->img) : h;
+      if (x0 >= x1 || y0 >= y1) continue;
+      Image part = ImageView(l->img, x0 - l->x, y0 - l->y, x1 - x0, y1 - y0);
+      if (l->mask == NULL && l->alpha == 1.0) {
+        ImagePaste(ref, x0, y0, part);
+      } else if (l->mask == NULL) {
+        ImageBlend(ref, x0, y0, part, l->alpha);
+      } else {
+        for (int y = y0; y < y1; y++) {
+          for (int x = x0; x < x1; x++) {
+            double a = l->alpha * ImageGetPixel(l->mask, x - l->x, y - l->y) / 100;
+            int v = blendLevel(ImageGetPixel(ref, x, y), ImageGetPixel(l->img, x - l->x, y - l->y), a, 200);
+            ImageSetPixel(ref, x, y, (uint8)v);
+          }
+        }
+      }
+      ImageDestroy(&part);
+    }
+    ImageComposite(dst, layer, n);
+    bad += !sameImage(dst, ref);
+    for (int k = 0; k < n; k++) {
+      ImageDestroy(&layer[k].img);
+      ImageDestroy(&layer[k].mask);
+    }
+    ImageDestroy(&dst);
+    ImageDestroy(&ref);
+  }
+  return bad;
+}
+
+// Reference convolution of pixel (x, y) of img (see ImageConvolve).
+static int convolveLevel(Image img, int x, int y, const double* kernel, int kw, int kh) {
+  double sum = 0.0, total = 0.0, inside = 0.0;
+  for (int j = 0; j < kh; j++) {
+    for (int i = 0; i < kw; i++) {
+      int u = x + i - kw/2;
+      int v = y + j - kh/2;
+      total += kernel[j*kw + i];
+      if (ImageValidPos(img, u, v)) {
+        sum += kernel[j*kw + i] * ImageGetPixel(img, u, v);
+        inside += kernel[j*kw + i];
+      }
+    }
+  }
+  if (total != 0.0 && inside != 0.0) sum *= total / inside;
+  double r = floor(sum + 0.5);
+  return (r < 0) ? 0 : (r > ImageMaxval(img)) ? ImageMaxval(img) : (int)r;
+}
+
+// ImageConvolve (in fixed point, separable or not) against the
+// definition, in double: results may differ by 1 level.
+static int checkConvolve(void) {
+  double sharpen[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+  double sobel[9] = { -1, 0, 1, -2, 0, 2, -1, 0, 1 };
+  double box[25], gauss[49], g[7], random[15];
+  double s = 0.0;
+  for (int i = 0; i < 25; i++) box[i] = 1.0 / 25;
+  for (int i = 0; i < 7; i++) s += g[i] = exp(-(i-3)*(i-3) / 4.0);
+  for (int i = 0; i < 49; i++) gauss[i] = g[i/7] * g[i%7] / (s*s);
+  for (int i = 0; i < 15; i++) random[i] = (rand() % 100 - 30) / 100.0;
+  struct { const double* kernel; int kw, kh; } test[] = {
+    { sharpen, 3, 3 }, { sobel, 3, 3 }, { box, 5, 5 }, { gauss, 7, 7 },
+    { random, 5, 3 }, { random, 3, 5 }, { g, 7, 1 }, { g, 1, 7 },
+  };
+  int bad = 0;
+  for (int k = 0; k < 8; k++) {
+    for (int size = 0; size < 3; size++) {
+      int w = (size == 0) ? 37 : (size == 1) ? 2 : 1 + rand() % 70;
+      int h = (size == 0) ? 29 : (size == 1) ? 3 : 1 + rand() % 70;
+      Image img = randomImage(w, h, 251, 250);
+      Image ref = ImageCrop(img, 0, 0, w, h);
+      ImageConvolve(img, test[k].kernel, test[k].kw, test[k].kh);
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+          int r = convolveLevel(ref, x, y, test[k].kernel, test[k].kw, test[k].kh);
+          bad += abs(ImageGetPixel(img, x, y) - r) > 1;
+        }
+      }
+      ImageDestroy(&img);
+      ImageDestroy(&ref);
+    }
+  }
+  return bad;
+}
+
+// ImageGaussianBlur against a true Gaussian, away from the borders: the
+// three box filters are an approximation, within a few levels.
+// Constant images must not change at all.
+static int checkGauss(void) {
+  double sigmas[] = { 0.5, 1.0, 2.0, 3.7 };
+  int bad = 0;
+  for (int k = 0; k < 4; k++) {
+    double sigma = sigmas[k];
+    int w = 61, h = 47;
+    Image img = randomImage(w, h, 256, 255);
+    Image ref = ImageCrop(img, 0, 0, w, h);
+    ImageGaussianBlur(img, sigma);
+    int r = (int)ceil(4 * sigma);
+    for (int y = r; y < h - r; y++) {
+      for (int x = r; x < w - r; x++) {
+        double sum = 0.0, weight = 0.0;
+        for (int j = -r; j <= r; j++) {
+          for (int i = -r; i <= r; i++) {
+            double g = exp(-(i*i + j*j) / (2 * sigma * sigma));
+            sum += g * ImageGetPixel(ref, x + i, y + j);
+            weight += g;
+          }
+        }
+        bad += fabs(sum / weight - ImageGetPixel(img, x, y)) > 4.0;
+      }
+    }
+    ImageDestroy(&img);
+    ImageDestroy(&ref);
+    Image flat = ImageCreate(w, h, 255);
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) ImageSetPixel(flat, x, y, 173);
+    }
+    ImageGaussianBlur(flat, sigma * 5);
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) bad += ImageGetPixel(flat, x, y) != 173;
+    }
+    ImageDestroy(&flat);
+  }
+  return bad;
+}
+
+static int compareLevels(const void* a, const void* b) {
+  return *(const uint8*)a - *(const uint8*)b;
+}
+
+// ImageMedian against sorting each window, on views of larger images.
+static int checkMedian(void) {
+  static uint8 window[41*41];
+  int bad = 0;
+  for (int t = 0; t < 200; t++) {
+    int w = 1 + rand() % 30, h = 1 + rand() % 30;
+    int dx = rand() % 20, dy = rand() % 20;
+    Image img = randomImage(w + 2, h + 1, (t % 3 == 0) ? 3 : 256, 255);
+    Image view = ImageView(img, 1, 1, w, h);
+    Image ref = ImageCrop(view, 0, 0, w, h);
+    ImageMedian(view, dx, dy);
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        int n = 0;
+        for (int v = y - dy; v <= y + dy; v++) {
+          for (int u = x - dx; u <= x + dx; u++) {
+            if (ImageValidPos(ref, u, v)) window[n++] = ImageGetPixel(ref, u, v);
+          }
+        }
+        qsort(window, n, 1, compareLevels);
+        bad += ImageGetPixel(view, x, y) != window[(n - 1) / 2];
+      }
+    }
+    ImageDestroy(&view);
+    ImageDestroy(&ref);
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// ImageErode/ImageDilate against the minimum/maximum of each window (on
+// gray and binary images), and ImageOpen/ImageClose against erode and
+// dilate in turn.
+static int checkMorphology(void) {
+  int bad = 0;
+  for (int t = 0; t < 120; t++) {
+    int w = 1 + rand() % 60, h = 1 + rand() % 60;
+    int dx = rand() % ((t % 3 == 0) ? 80 : 12);
+    int dy = rand() % ((t % 3 == 0) ? 80 : 12);
+    Image img = randomImage(w, h, 201, 200);
+    if (t % 2) ImageThreshold(img, 40);
+    for (int erode = 0; erode < 2; erode++) {
+      Image out = ImageCrop(img, 0, 0, w, h);
+      if (erode) ImageErode(out, dx, dy);
+      else ImageDilate(out, dx, dy);
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+          int best = erode ? 255 : 0;
+          for (int v = y - dy; v <= y + dy; v++) {
+            for (int u = x - dx; u <= x + dx; u++) {
+              if (!ImageValidPos(img, u, v)) continue;
+              int p = ImageGetPixel(img, u, v);
+              if (erode ? p < best : p > best) best = p;
+            }
+          }
+          bad += ImageGetPixel(out, x, y) != best;
+        }
+      }
+      // Opening (or closing) is the same filter, then its dual
+      Image both = ImageCrop(img, 0, 0, w, h);
+      Image ref = ImageCrop(img, 0, 0, w, h);
+      if (erode) {
+        ImageOpen(both, dx, dy);
+        ImageErode(ref, dx, dy);
+        ImageDilate(ref, dx, dy);
+      } else {
+        ImageClose(both, dx, dy);
+        ImageDilate(ref, dx, dy);
+        ImageErode(ref, dx, dy);
+      }
+      bad += !sameImage(both, ref);
+      ImageDestroy(&out);
+      ImageDestroy(&both);
+      ImageDestroy(&ref);
+    }
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// Compare the summed-area tables of img with sums over each rectangle
+// in a list of corner cases and random rectangles.
+static int integralRects(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  ImageIntegral ii = ImageIntegralGet(img);
+  if (ii == NULL) error(2, errno, "Summed-area tables: %s", ImageErrMsg());
+  int bad = 0;
+  for (int t = 0; t < 300; t++) {
+    int x, y, rw, rh;
+    switch (t) {
+    case 0:  x = 0; y = 0; rw = w; rh = h; break;          // whole image
+    case 1:  x = w - 1; y = h - 1; rw = 1; rh = 1; break;  // last pixel
+    case 2:  x = w / 2; y = 0; rw = w - x; rh = h; break;  // right edge
+    case 3:  x = 0; y = h / 2; rw = w; rh = h - y; break;  // bottom edge
+    default:
+      x = rand() % w; y = rand() % h;
+      rw = 1 + rand() % (w - x); rh = 1 + rand() % (h - y);
+    }
+    uint64_t s = 0, q = 0;
+    for (int j = y; j < y + rh; j++) {
+      for (int i = x; i < x + rw; i++) {
+        uint64_t p = ImageGetPixel(img, i, j);
+        s += p;
+        q += p * p;
+      }
+    }
+    double n = (double)rw * rh;
+    double var = ((double)q - (double)s * s / n) / n;
+    bad += ImageRectSum(ii, x, y, rw, rh) != s;
+    bad += ImageRectSum(ii, x, y, 0, rh) != 0;
+    bad += fabs(ImageRectMean(ii, x, y, rw, rh) - s / n) > 1e-9 * (1 + s / n);
+    bad += fabs(ImageRectVariance(ii, x, y, rw, rh) - var) > 1e-6 * (1 + var);
+  }
+  return bad;
+}
+
+// ImageIntegralGet against direct sums, on images large enough for the
+// squared sums to need more than 32 bits, and again after ImageSetPixel
+// so the cached tables must be recomputed.
+static int checkIntegral(void) {
+  int bad = 0;
+  for (int t = 0; t < 3; t++) {
+    Image img = randomImage(500 + 71*t, 400 + 43*t, 256, 255);
+    bad += integralRects(img);
+    bad += ImageIntegralGet(img) != ImageIntegralGet(img);
+    for (int k = 0; k < 5; k++) {
+      int x = rand() % ImageWidth(img), y = rand() % ImageHeight(img);
+      ImageSetPixel(img, x, y, 255 - ImageGetPixel(img, x, y));
+    }
+    bad += integralRects(img);
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// Reference score of tmpl at (x, y) in img (see ImageMatchScore).
+static double matchScore(Image img, int x, int y, Image tmpl, ImageMetric metric) {
+  double n = (double)ImageWidth(tmpl) * ImageHeight(tmpl);
+  double sad = 0, ssd = 0, s1 = 0, s2 = 0, t1 = 0, t2 = 0, c = 0;
+  for (int j = 0; j < ImageHeight(tmpl); j++) {
+    for (int i = 0; i < ImageWidth(tmpl); i++) {
+      double p = ImageGetPixel(img, x + i, y + j);
+      double q = ImageGetPixel(tmpl, i, j);
+      sad += fabs(p - q);
+      ssd += (p - q) * (p - q);
+      s1 += p;
+      s2 += p * p;
+      t1 += q;
+      t2 += q * q;
+      c += p * q;
+    }
+  }
+  if (metric == IMAGE_SAD) return sad;
+  if (metric == IMAGE_SSD) return ssd;
+  double vs = n * s2 - s1 * s1;
+  double vt = n * t2 - t1 * t1;
+  if (vs <= 0 || vt <= 0) return 0.0;  // flat window or template
+  return (n * c - s1 * t1) / sqrt(vs * vt);
+}
+
+// ImageMatchScore (direct and with FFTs) against the definitions, and
+// ImageMatchBest on a template pasted into the image.
+static int checkMatch(void) {
+  // (SSD scores of the largest template pass 2^24, beyond what a float holds)
+  int sizes[][2] = { { 1, 1 }, { 5, 4 }, { 24, 20 }, { 40, 35 }, { 64, 3 }, { 60, 45 } };
+  int bad = 0;
+  for (int t = 0; t < 10; t++) {
+    Image img = randomImage(64 + rand() % 30, 48 + rand() % 30, (t % 2) ? 4 : 256, 255);
+    int w = ImageWidth(img), h = ImageHeight(img);
+    for (int k = 0; k < 6; k++) {
+      Image tmpl = randomImage(sizes[k][0], sizes[k][1], (t == 0) ? 1 : 256, 255);
+      for (ImageMetric metric = IMAGE_SAD; metric <= IMAGE_NCC; metric++) {
+        double* score = ImageMatchScore(img, tmpl, metric);
+        if (score == NULL) {
+          error(2, errno, "Matching: %s", ImageErrMsg());
+        }
+        int n = w - ImageWidth(tmpl) + 1;
+        for (int y = 0; y + ImageHeight(tmpl) <= h; y++) {
+          for (int x = 0; x < n; x++) {
+            double r = matchScore(img, x, y, tmpl, metric);
+            double tol = (metric == IMAGE_NCC) ? 1e-4 : 0.0;
+            bad += fabs(score[y*n + x] - r) > tol;
+          }
+        }
+        free(score);
+      }
+      // A pasted copy is the best match for SAD and SSD
+      int x = rand() % (w - ImageWidth(tmpl) + 1);
+      int y = rand() % (h - ImageHeight(tmpl) + 1);
+      Image copy = ImageCrop(img, 0, 0, w, h);
+      ImagePaste(copy, x, y, tmpl);
+      ImagePos pos[3];
+      double best[3];
+      for (ImageMetric metric = IMAGE_SAD; metric <= IMAGE_SSD; metric++) {
+        int found = ImageMatchBest(copy, tmpl, metric, 3, pos, best);
+        bad += found < 1 || best[0] != 0.0 || matchScore(copy, pos[0].x, pos[0].y, tmpl, metric) != 0.0;
+      }
+      ImageDestroy(&copy);
+      ImageDestroy(&tmpl);
+    }
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// The locate functions against trying every position with
+// ImageMatchSubImage.
+static int checkLocate(void) {
+  int bad = 0;
+  for (int t = 0; t < 60; t++) {
+    int w = 20 + rand() % 150, h = 20 + rand() % 150;
+    Image img = randomImage(w, h, (t % 3 == 0) ? 2 : 256, 255);
+    Image tmpl[4];
+    for (int k = 0; k < 4; k++) {
+      int tw = 1 + rand() % (w / 2), th = 1 + rand() % (h / 2);
+      tmpl[k] = ImageCrop(img, rand() % (w - tw + 1), rand() % (h - th + 1), tw, th);
+      if (k == 3) ImageNegative(tmpl[k]);  // most likely not found
+    }
+    ImagePos many[4];
+    ImageLocateMany(img, tmpl, 4, many);
+    for (int k = 0; k < 4; k++) {
+      ImagePos* pos = NULL;
+      int cap = 0;
+      int n = ImageLocateAll(img, tmpl[k], &pos, &cap, 0, NULL);
+      int found = 0;
+      ImagePos first = { -1, -1 };
+      for (int y = 0; y + ImageHeight(tmpl[k]) <= h; y++) {
+        for (int x = 0; x + ImageWidth(tmpl[k]) <= w; x++) {
+          if (!ImageMatchSubImage(img, x, y, tmpl[k])) continue;
+          if (found == 0) first = (ImagePos){ x, y };
+          bad += found >= n || pos[found].x != x || pos[found].y != y;
+          found++;
+        }
+      }
+      bad += found != n;
+      free(pos);
+      int x = -1, y = -1;
+      bad += ImageLocateSubImage(img, &x, &y, tmpl[k]) != (found > 0);
+      bad += found > 0 && (x != first.x || y != first.y);
+      x = y = -1;
+      bad += ImageLocatePyramid(img, &x, &y, tmpl[k]) != (found > 0);
+      bad += found > 0 && (x != first.x || y != first.y);
+      bad += many[k].x != first.x || many[k].y != first.y;
+    }
+    for (int k = 0; k < 4; k++) ImageDestroy(&tmpl[k]);
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// The levels of ImagePyramidGet against averaging 2x2 blocks (also after
+// a write), and ImageLocatePyramid against ImageLocateSubImage, on images
+// large enough for the search to start at level 2 or deeper.
+static int checkPyramid(void) {
+  int bad = 0;
+  for (int t = 0; t < 12; t++) {
+    int w = 320 + rand() % 200, h = 320 + rand() % 200;
+    Image img = randomImage(w, h, (t % 3 == 0) ? 2 : 256, 255);
+    for (int pass = 0; pass < 2; pass++) {
+      if (pass == 1) ImageSetPixel(img, 0, 0, ~ImageGetPixel(img, 0, 0));  // drops the cache
+      ImagePyramid pyr = ImagePyramidGet(img, 4);
+      if (pyr == NULL) {
+        error(2, errno, "Building pyramid: %s", ImageErrMsg());
+      }
+      bad += ImagePyramidDepth(pyr) != 4;
+      for (int k = 1; k < ImagePyramidDepth(pyr); k++) {
+        Image fine = ImagePyramidLevel(pyr, k - 1);
+        Image coarse = ImagePyramidLevel(pyr, k);
+        bad += ImageWidth(coarse) != ImageWidth(fine) / 2;
+        bad += ImageHeight(coarse) != ImageHeight(fine) / 2;
+        for (int y = 0; y < ImageHeight(coarse); y++) {
+          for (int x = 0; x < ImageWidth(coarse); x++) {
+            int sum = ImageGetPixel(fine, 2*x, 2*y) + ImageGetPixel(fine, 2*x + 1, 2*y) +
+                      ImageGetPixel(fine, 2*x, 2*y + 1) + ImageGetPixel(fine, 2*x + 1, 2*y + 1);
+            bad += ImageGetPixel(coarse, x, y) != (sum + 2) / 4;
+          }
+        }
+      }
+    }
+    // Templates of 20 to min(w,h)/8 pixels a side: at least 4x4 blocks of
+    // 4x4 pixels for every phase, and 16 times smaller than img
+    for (int k = 0; k < 4; k++) {
+      int side = (w < h ? w : h) / 8;
+      int tw = 20 + rand() % (side - 19), th = 20 + rand() % (side - 19);
+      Image tmpl = ImageCrop(img, rand() % (w - tw + 1), rand() % (h - th + 1), tw, th);
+      if (k == 3) ImageSetPixel(tmpl, tw / 2, th / 2, ~ImageGetPixel(tmpl, tw / 2, th / 2));
+      int x1 = -1, y1 = -1, x2 = -1, y2 = -1;
+      int found1 = ImageLocatePyramid(img, &x1, &y1, tmpl);
+      int found2 = ImageLocateSubImage(img, &x2, &y2, tmpl);
+      bad += found1 != found2 || x1 != x2 || y1 != y2;
+      ImageDestroy(&tmpl);
+    }
+    ImageDestroy(&img);
+  }
+  return bad;
+}
+
+// Run all the checks, reporting each one.
+// Returns the number of checks that failed.
+static int runChecks(void) {
+  struct { const char* name; int (*run)(void); } checks[] = {
+    { "views", checkViews },
+    { "loadmany", checkLoadMany },
+    { "pool", checkPool },
+    { "rotate", checkRotate },
+    { "histogram", checkHistogram },
+    { "blend", checkBlend },
+    { "composite", checkComposite },
+    { "convolve", checkConvolve },
+    { "gauss", checkGauss },
+    { "median", checkMedian },
+    { "morphology", checkMorphology },
+    { "integral", checkIntegral },
+    { "match", checkMatch },
+    { "locate", checkLocate },
+    { "pyramid", checkPyramid },
+  };
+  int failed = 0;
+  srand(2023);
+  for (int k = 0; k < (int)(sizeof(checks) / sizeof(checks[0])); k++) {
+    int bad = checks[k].run();
+    if (bad == 0) {
+      printf("# CHECK %s: OK\n", checks[k].name);
+    } else {
+      printf("# CHECK %s: FAILED (%d mismatches)\n", checks[k].name, bad);
+      failed++;
+    }
+  }
+  return failed;
+}
+
 int main(int argc, char* argv[]) {
   program_name = argv[0];
+  if (argc == 2 && strcmp(argv[1], "check") == 0) {
+    ImageInit();
+    return runChecks() > 0;
+  }
   if (argc != 3) {
-    error(1, 0, "Usage: imageTest input.pgm output.pgm");
+    error(1, 0, "Usage: imageTest input.pgm output.pgm\n       imageTest check");
   }
 
   ImageInit();
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <math.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
@@ -37,7 +38,8 @@ static const char* USAGE =
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  info            Show information on CURR (size, range, mean, stddev\n"
+    "                  and percentiles)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
@@ -47,21 +49,39 @@ static const char* USAGE =
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  rotate270       Rotate CURR 90º clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "                  (a copy-on-write view: no pixels are copied)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
-    "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locate [N]      Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "                  (with N, search the N images before CURR in one pass)\n"
+    "  locatepyr       Like locate, but search coarse-to-fine on a pyramid\n"
+    "  locateall       Search PRED in CURR, print all matching positions,\n"
+    "                  or NOTFOUND\n"
+    "  match M,K       Search PRED in CURR approximately, print the K best\n"
+    "                  positions and scores with metric M (sad, ssd or ncc)\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    apply (2DX+1)x(2DY+1) median filter to CURR\n"
+    "  erode DX,DY     erode CURR with (2DX+1)x(2DY+1) rectangle (minimum)\n"
+    "  dilate DX,DY    dilate CURR with (2DX+1)x(2DY+1) rectangle (maximum)\n"
+    "  open DX,DY      open CURR (erode, then dilate)\n"
+    "  close DX,DY     close CURR (dilate, then erode)\n"
+    "  gauss SIGMA     blur CURR using Gaussian filter with std. deviation SIGMA\n"
+    "  conv KW,KH,K... convolve CURR with KWxKH kernel K (KW*KH weights,\n"
+    "                  row by row; KW and KH odd)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  K...            Comma-separated list of weights\n"
     "\n"
     ;
 
@@ -97,22 +117,42 @@ int main(int ac, char* av[]) {
   int x, y, w, h;
 
   // The image buffer
-  const int N = 10;   // buffer capacity
+  const int N = 64;   // buffer capacity
   Image img[N];     // the images
   int n = 0;          // number of images created
 
+  // Consecutive point operations (neg, thr, bri) on CURR are composed
+  // into a single lookup table, applied in one pass before the next
+  // operation of any other kind.
+  uint8 lut[256];
+  int pending = 0;    // lut holds operations not yet applied to CURR?
+
   int k = 1;
   while (k < ac) {
+    int pointOp = strcmp(av[k], "neg") == 0 || strcmp(av[k], "thr") == 0 ||
+                  strcmp(av[k], "bri") == 0;
+    if (pending && !pointOp) {
+      ImageApplyLUT(img[n-1], lut);
+      pending = 0;
+    }
+    if (!pending) ImageLUTIdentity(lut);
+
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
+      ImageHist hist;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
+      ImageHistogram(img[n-1], &hist);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      printf("# Gray level range: [%hhu, %hhu]\n", hist.min, hist.max);
+      printf("# Mean: %.3f\n# Stddev: %.3f\n", ImageHistMean(&hist), ImageHistStddev(&hist));
+      printf("# Percentiles 1,5,25,50,75,95,99: %d %d %d %d %d %d %d\n",
+             ImageHistPercentile(&hist, 1), ImageHistPercentile(&hist, 5),
+             ImageHistPercentile(&hist, 25), ImageHistPercentile(&hist, 50),
+             ImageHistPercentile(&hist, 75), ImageHistPercentile(&hist, 95),
+             ImageHistPercentile(&hist, 99));
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
@@ -120,21 +160,24 @@ int main(int ac, char* av[]) {
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      ImageLUTNegative(lut, ImageMaxval(img[n-1]));
+      pending = 1;
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      ImageLUTThreshold(lut, ImageMaxval(img[n-1]), (uint8)thr);
+      pending = 1;
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      ImageLUTBrighten(lut, ImageMaxval(img[n-1]), factor);
+      pending = 1;
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
@@ -151,6 +194,20 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating 180º I%d -> I%d\n", n-1, n);
+      img[n] = ImageRotate180(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate270") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating 270º I%d -> I%d\n", n-1, n);
+      img[n] = ImageRotate270(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -165,7 +222,7 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
+      img[n] = ImageView(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
@@ -188,13 +245,80 @@ int main(int ac, char* av[]) {
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
     } else if (strcmp(av[k], "locate") == 0) {
+      // The count is optional: take the next argument only if it is a number
+      int many = 1;
+      char tail;
+      if (k + 1 < ac && sscanf(av[k+1], "%d%c", &many, &tail) == 1) {
+        k++;
+        if (many < 1) { err = 5; break; }
+      } else {
+        many = 1;
+      }
+      if (n < many + 1) { err = 2; break; }
+      if (many == 1) {
+        fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
+        if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+          printf("# FOUND (%d,%d)\n", x, y);
+        } else {
+          printf("# NOTFOUND\n");
+        }
+      } else {
+        fprintf(stderr, "Locating I%d..I%d in I%d\n", n-1-many, n-2, n-1);
+        ImagePos pos[N];
+        if (ImageLocateMany(img[n-1], img + n-1-many, many, pos) < 0) { err = 4; break; }
+        for (int i = 0; i < many; i++) {
+          if (pos[i].x >= 0) {
+            printf("# I%d FOUND (%d,%d)\n", n-1-many+i, pos[i].x, pos[i].y);
+          } else {
+            printf("# I%d NOTFOUND\n", n-1-many+i);
+          }
+        }
+      }
+    } else if (strcmp(av[k], "locatepyr") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+      fprintf(stderr, "Locating I%d in I%d with a pyramid\n", n-2, n-1);
+      int found = ImageLocatePyramid(img[n-1], &x, &y, img[n-2]);
+      if (found < 0) { err = 4; break; }
+      if (found) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating all I%d in I%d\n", n-2, n-1);
+      ImagePos* pos = NULL;
+      int cap = 0;
+      int found = ImageLocateAll(img[n-1], img[n-2], &pos, &cap, 0, NULL);
+      if (found < 0) { free(pos); err = 4; break; }
+      for (int i = 0; i < found; i++) {
+        printf("# FOUND (%d,%d)\n", pos[i].x, pos[i].y);
+      }
+      if (found == 0) printf("# NOTFOUND\n");
+      free(pos);
+    } else if (strcmp(av[k], "match") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      char name[4];
+      int best;
+      if (sscanf(av[k], "%3[a-z],%d", name, &best) != 2) { err = 5; break; }
+      ImageMetric metric;
+      if (strcmp(name, "sad") == 0) metric = IMAGE_SAD;
+      else if (strcmp(name, "ssd") == 0) metric = IMAGE_SSD;
+      else if (strcmp(name, "ncc") == 0) metric = IMAGE_NCC;
+      else { err = 5; break; }
+      if (best < 1 || best > 1000) { err = 5; break; }
+      if (ImageWidth(img[n-2]) == 0 || ImageHeight(img[n-2]) == 0 ||
+          ImageWidth(img[n-2]) > ImageWidth(img[n-1]) ||
+          ImageHeight(img[n-2]) > ImageHeight(img[n-1])) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Matching I%d in I%d (%s)\n", n-2, n-1, name);
+      ImagePos pos[1000];
+      double score[1000];
+      int found = ImageMatchBest(img[n-1], img[n-2], metric, best, pos, score);
+      if (found < 0) { err = 4; break; }
+      for (int i = 0; i < found; i++) {
+        printf("# MATCH (%d,%d) %g\n", pos[i].x, pos[i].y, score[i]);
+      }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -202,6 +326,57 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0 || dy >= 32768) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Median I%d with %dx%d filter\n", n-1, 2*dx+1, 2*dy+1);
+      ImageMedian(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Morphology %s I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      switch (op[0]) {
+        case 'e': ImageErode(img[n-1], dx, dy); break;
+        case 'd': ImageDilate(img[n-1], dx, dy); break;
+        case 'o': ImageOpen(img[n-1], dx, dy); break;
+        default: ImageClose(img[n-1], dx, dy); break;
+      }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1) { err = 5; break; }
+      if (!(sigma >= 0.0)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Gaussian blur I%d with sigma=%.3f\n", n-1, sigma);
+      ImageGaussianBlur(img[n-1], sigma);
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int kw, kh, len;
+      if (sscanf(av[k], "%d,%d%n", &kw, &kh, &len) != 2) { err = 5; break; }
+      if (kw <= 0 || kh <= 0 || kw % 2 == 0 || kh % 2 == 0 || kw > 999 || kh > 999) { err = 5; break; }
+      double* kernel = malloc((size_t)kw * kh * sizeof(double));
+      if (kernel == NULL) { err = 4; break; }
+      const char* p = av[k] + len;
+      double sumabs = 0.0;
+      int i;
+      for (i = 0; i < kw * kh; i++, p += len) {   // precondition check!
+        if (sscanf(p, ",%lf%n", &kernel[i], &len) != 1) break;
+        if (!(fabs(kernel[i]) <= 32767.0)) break;
+        sumabs += fabs(kernel[i]);
+      }
+      if (i < kw * kh || *p != '\0' || sumabs > 4210752.0) { free(kernel); err = 5; break; }
+      fprintf(stderr, "Convolving I%d with %dx%d kernel\n", n-1, kw, kh);
+      ImageConvolve(img[n-1], kernel, kw, kh);
+      free(kernel);
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -210,17 +385,19 @@ int main(int ac, char* av[]) {
     } else {  // image file
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      img[n] = ImageLoadMapped(av[k]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
     k++;
   }
+  // (Operations still pending at the end would not be observed.)
   
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
+  ImagePoolFlush();
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;